@@ -1,10 +1,51 @@
-/* gcc gc.c -O2 -Wall -Wextra -lm -o gc && ./gc */
+/* gcc gc.c -O2 -Wall -Wextra -pthread -lm -o gc && ./gc */
+#define ALIGNMENT 16
+#define CONSTANT_CHUNK_SIZE (1 << 16)
+#define DEDUPLICATION_AGE 3
+#define DUPLICATE_AGE 255
+#define FLOAT_ALIGNMENT 32
+#define HANDLE_BLOCK_SIZE 256
+#define HEAP_PAGE_SIZE (1 << 20)
+#define HUGE_OBJECT_LIMIT (1 << 21)
 #define INITIAL_ARRAY_SIZE 16
-#define STACK_SIZE 256
+#define INITIAL_MAP_SIZE 16
+#define INITIAL_OBJECT_TABLE_SIZE 64
+#define INITIAL_PRINT_TABLE_SIZE 16
+#define INITIAL_PROGRAM_SIZE 64
+#define INITIAL_STACK_SIZE 256
+#define JIT_PERF_MAP_SIZE 64
+#define MAP_DELETED 0xfe
+#define MAP_EMPTY 0x80
+#define MAP_GROUP_SIZE 16
+#define MAXIMUM_INLINE_ARRAY_SIZE 8
+#define MAXIMUM_SMALL_INTEGER 1023
+#define MAXIMUM_STACK_SIZE (1 << 24)
+#define MINIMUM_SMALL_INTEGER -128
+#define NUMBER_SIZE 32
+#define OUTPUT_BUFFER_SIZE 65536
+#define SIZE_CLASSES (SMALL_OBJECT_LIMIT / ALIGNMENT + 1)
+#define SMALL_OBJECT_LIMIT 4096
+#define TLAB_SIZE (1 << 15)
+#define _GNU_SOURCE
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "gc.h"
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT
+#include <unistd.h>
+#endif
+#if defined(__x86_64__)
+#define SIMD
+#include <immintrin.h>
+#endif
 
 /*
  * This code shows how to write a simple "stop-the-world mark and sweep" garbage
@@ -21,23 +62,61 @@
  * and cdr in lisp, but here they are called head and tail. Of course you can
  * expand the type system to contain more data types.
  *
+ * We did: a float array is an array of numbers stored unboxed, i.e. as plain
+ * doubles rather than as pointers to number objects. A million numbers then
+ * take a single allocation instead of a million, and the garbage collector
+ * never has to look inside, because doubles cannot reference other objects.
+ *
+ * A list is a run of pairs stored compactly as one object, described further
+ * below. A map is a hash table mapping keys to values, also described below.
+ *
+ * Caches need objects that reference others without keeping them alive. A weak
+ * reference points to a target that the garbage collector may delete anyway,
+ * after which the reference points to nothing. An ephemeron table is a hash
+ * table, like a map, that keeps a value alive only as long as its key is alive
+ * for some other reason. Entries whose keys are deleted vanish from the table.
+ *
  * An object in our system is a "tagged union" with a type tag telling us which
  * data type it is. Objects also contain a mark used by the garbage collector
  * (1 = reachable; 0 = unreachable) and a pointer to another object so that we
  * can implement a linked list of objects.
+ *
+ * The characters of a string are part of the object. They start right after
+ * its length, and a string object is allocated as long as they need, so
+ * strings of up to 11 characters take no more room than any other object, a
+ * string of 27 characters takes 48 bytes and so on. Interned strings and
+ * hash-consed pairs, which are explained further below, are flagged by
+ * "interned". The "age" of an object counts the collections it survived, up
+ * to DEDUPLICATION_AGE; it matters for string deduplication, also explained
+ * below.
+ *
+ * The elements of small arrays are part of the object as well, following it in
+ * memory; "inline_size" says how many there is room for. Arrays that outgrow
+ * them, or are too large from the start, keep their elements in an elements
+ * object, which is allocated and collected like any other object but only ever
+ * referenced by its array.
  */
 enum Type
 {
     ARRAY,
+    ELEMENTS,
+    EPHEMERON_TABLE,
+    FLOAT_ARRAY,
+    LIST,
+    MAP,
     NUMBER,
     PAIR,
-    STRING
+    STRING,
+    WEAK_REF
 };
 
 struct Object
 {
     enum Type type;
-    int mark;
+    unsigned char mark;
+    unsigned char inline_size;
+    unsigned char interned;
+    unsigned char age;
     struct Object *next;
     union
     {
@@ -45,7 +124,12 @@ struct Object
         {
             int length;
             int size;
-            struct Object **array;
+            union
+            {
+                struct Object **array;
+                double *floats;
+                struct MapTable *table;
+            };
         };
         double number;
         struct
@@ -53,530 +137,4577 @@ struct Object
             struct Object *head;
             struct Object *tail;
         };
-        char *string;
+        struct
+        {
+            int string_length;
+            char characters[];
+        };
+        struct
+        {
+            int element_capacity;
+            struct Object *elements[];
+        };
+        struct
+        {
+            int list_length;
+            struct Object *list_tail;
+            struct Object *heads[];
+        };
+        struct Object *target;
     };
 };
 
 /*
- * We implement a linked list of all the objects currently in existence,
- * reachable or unreachable.
+ * A growable stack of objects.
  */
-struct Object *list_of_objects = NULL;
+struct ObjectStack
+{
+    int length;
+    int size;
+    struct Object **objects;
+};
+
+void push_object(struct ObjectStack *stack, struct Object *object)
+{
+    if (stack->length == stack->size)
+    {
+        stack->size = stack->size ? stack->size * 2 : INITIAL_ARRAY_SIZE;
+        stack->objects = realloc(stack->objects, stack->size * sizeof(struct Object *));
+    }
+    stack->objects[stack->length] = object;
+    stack->length++;
+}
 
 /*
- * This function creates a new object and adds it to the linked list. Don't use
- * this function directly, call the type specific functions instead.
+ * A hash table of strings or pairs, used for interning, hash-consing and
+ * deduplication.
  */
-struct Object *new_object(void)
+struct ObjectTable
 {
-    struct Object *object = malloc(sizeof(struct Object));
-    object->mark = 0;
-    object->next = list_of_objects;
-    list_of_objects = object;
-    return object;
-}
+    struct Object **objects;
+    int count;
+    int size;
+};
 
 /*
- * Each array object has an array of pointers to objects, but this array is
- * allocated somewhere else and not directly part of the tagged union, which
- * contains only a pointer to the array. If the array where part of the tagged
- * union, we would have to have a fixed array size and the array would
- * unnecessarily increase the size of the tagged union.
+ * Ephemerons waiting for their keys to be marked, explained further below.
  */
-struct Object *new_array(void)
+struct PendingEphemerons
 {
-    struct Object *object = new_object();
-    object->type = ARRAY;
-    object->length = 0;
-    object->size = INITIAL_ARRAY_SIZE;
-    object->array = calloc(INITIAL_ARRAY_SIZE, sizeof(struct Object *));
-    return object;
-}
+    struct Object **slots;
+    int pending;
+    int used;
+    int size;
+};
 
-struct Object *new_number(double number)
+/*
+ * A chunk of memory holding constants, explained further below.
+ */
+struct ConstantChunk
 {
-    struct Object *object = new_object();
-    object->type = NUMBER;
-    object->number = number;
-    return object;
-}
+    struct ConstantChunk *next;
+    char *memory;
+    char *top;
+    char *end;
+};
 
-struct Object *new_pair(struct Object *head, struct Object *tail)
+/*
+ * Objects are allocated from a heap made of large pages. A heap may be shared
+ * by several threads, so handing out memory from its pages needs a lock. To
+ * keep that lock off the common path, every thread takes a whole chunk of a
+ * page at a time, its thread-local allocation buffer (TLAB), and allocates
+ * objects from it by simply bumping a pointer.
+ *
+ * Memory of deleted objects goes onto free lists, one per size class, i.e. per
+ * multiple of ALIGNMENT bytes. Objects larger than SMALL_OBJECT_LIMIT are kept
+ * apart, in the large object space.
+ */
+struct Page
 {
-    struct Object *object = new_object();
-    object->type = PAIR;
-    object->head = head;
-    object->tail = tail;
-    return object;
-}
+    struct Page *next;
+};
 
-struct Object *new_string(char *string)
+struct VM;
+
+/*
+ * Objects owning resources outside the heap, e.g. file handles, can have a
+ * finalizer registered, a function to release those resources. It is called on
+ * a thread of its own, see further below.
+ */
+struct Finalizer
 {
-    struct Object *object = new_object();
-    object->type = STRING;
-    object->string = calloc(strlen(string) + 1, sizeof(char));
-    strcpy(object->string, string);
-    return object;
-}
+    struct Object *object;
+    void (*function)(struct VM *vm, struct Object *object, void *data);
+    void *data;
+    struct Finalizer *next;
+};
+
+struct Heap
+{
+    pthread_mutex_t lock;
+    struct Page *pages;
+    char *page_top;
+    char *page_end;
+    void *free_lists[SIZE_CLASSES];
+    struct VM *mutators;
+    int mutator_count;
+    int stopped_count;
+    atomic_int safepoint_requested;
+    pthread_cond_t stopped;
+    pthread_cond_t resumed;
+    struct Object *orphans;
+    struct Object *large_objects;
+    int safepoints;
+    double total_time_to_safepoint;
+    double maximum_time_to_safepoint;
+    struct ObjectStack weak_refs;
+    struct ObjectStack ephemeron_tables;
+    struct PendingEphemerons ephemerons;
+    struct ObjectStack ephemeron_values;
+    int resolving_ephemerons;
+    struct ObjectTable interned_strings;
+    struct ObjectTable hash_consed_pairs;
+    struct Object *small_integers;
+    struct ConstantChunk *constants;
+    int hash_cons_pairs;
+    int huge_pages;
+    int deduplicate_strings;
+    int deduplicated_strings;
+    size_t deduplicated_bytes;
+    struct Finalizer *finalizers;
+    struct Finalizer *finalization_queue;
+    struct VM *finalizer_vm;
+    pthread_t finalizer_thread;
+    pthread_cond_t finalizable;
+    int finalizers_stopping;
+};
 
 /*
- * A function to delete objects. Never call this function directly, as it will
- * not properly unchain the object from the linked list. Call the garbage
- * collector instead and let it do all the clean-up.
+ * Everything an interpreter needs lives in a context, its virtual machine.
+ * Since nothing is shared between virtual machines, each with its own stack,
+ * program and collector, several interpreters can run at the same time on
+ * different threads without any locks. The fields are explained where they are
+ * used.
  *
- * Note that elements of data structures are not deleted recursively. The might
- * still be referenced from somewhere else and we'll leave it to the garbage
- * collector to figure that out.
+ * The objects of a virtual machine are allocated from its heap, either a heap
+ * of its own or one shared with other virtual machines, and are chained
+ * together in a linked list of all the objects currently in existence,
+ * reachable or unreachable.
  */
-void delete_object(struct Object *object)
+struct Instruction;
+
+struct VM
 {
-    if (object)
+    struct Heap *heap;
+    int owns_heap;
+    struct VM *next_mutator;
+    char *tlab_top;
+    char *tlab_end;
+    void *free_lists[SIZE_CLASSES];
+    struct Object *list_of_objects;
+    struct Object **stack;
+    int stack_length;
+    int stack_size;
+    struct HandleBlock *handle_block;
+    struct Object **handle_top;
+    struct Object **handle_end;
+    char *code;
+    char *to;
+    char *from;
+    struct ConstantChunk *constants;
+    struct Instruction *program;
+    int program_length;
+    int program_size;
+    int output_length;
+    char output_buffer[OUTPUT_BUFFER_SIZE];
+#ifdef JIT
+    unsigned char *jit_buffer;
+    int jit_length;
+    int jit_size;
+    void (*jit_code)(void);
+    size_t jit_code_size;
+#endif
+};
+
+struct Heap *new_heap(void)
+{
+    struct Heap *heap = calloc(1, sizeof(struct Heap));
+    int i;
+    pthread_mutex_init(&heap->lock, NULL);
+    pthread_cond_init(&heap->stopped, NULL);
+    pthread_cond_init(&heap->resumed, NULL);
+    pthread_cond_init(&heap->finalizable, NULL);
+    heap->small_integers = calloc(MAXIMUM_SMALL_INTEGER - MINIMUM_SMALL_INTEGER + 1, sizeof(struct Object));
+    for (i = 0; i <= MAXIMUM_SMALL_INTEGER - MINIMUM_SMALL_INTEGER; i++)
     {
-        switch (object->type)
-        {
-            case ARRAY:
-                free(object->array);
-                break;
-            case NUMBER:
-                break;
-            case PAIR:
-                break;
-            case STRING:
-                free(object->string);
-                break;
-        }
-        free(object);
+        heap->small_integers[i].type = NUMBER;
+        heap->small_integers[i].mark = 1;
+        heap->small_integers[i].number = MINIMUM_SMALL_INTEGER + i;
     }
+    return heap;
 }
 
+void delete_object(struct VM *, struct Object *);
+void stop_finalizer_thread(struct Heap *);
+
 /*
- * Functions for array operations.
+ * Deletes a heap once no virtual machine uses it anymore, along with the
+ * objects they left behind.
  */
-void append_element(struct Object *array, struct Object *element)
+void delete_heap(struct Heap *heap)
 {
-    if (array->length == array->size)
+    struct Page *page;
+    struct Object *object;
+    struct Finalizer *finalizer;
+    struct ConstantChunk *chunk;
+    stop_finalizer_thread(heap);
+    while (heap->finalizers)
     {
-        array->size *= 2;
-        array->array = realloc(array->array, array->size * sizeof(struct Object *));
+        finalizer = heap->finalizers;
+        heap->finalizers = finalizer->next;
+        free(finalizer);
     }
-    array->array[array->length] = element;
-    array->length++;
+    while (heap->orphans)
+    {
+        object = heap->orphans;
+        heap->orphans = object->next;
+        delete_object(NULL, object);
+    }
+    while (heap->large_objects)
+    {
+        object = heap->large_objects;
+        heap->large_objects = object->next;
+        delete_object(NULL, object);
+    }
+    while (heap->pages)
+    {
+        page = heap->pages;
+        heap->pages = page->next;
+        free(page);
+    }
+    free(heap->weak_refs.objects);
+    free(heap->ephemeron_tables.objects);
+    free(heap->ephemerons.slots);
+    free(heap->ephemeron_values.objects);
+    free(heap->interned_strings.objects);
+    free(heap->hash_consed_pairs.objects);
+    free(heap->small_integers);
+    while (heap->constants)
+    {
+        chunk = heap->constants;
+        heap->constants = chunk->next;
+        munmap(chunk->memory, chunk->end - chunk->memory);
+        free(chunk);
+    }
+    pthread_cond_destroy(&heap->stopped);
+    pthread_cond_destroy(&heap->resumed);
+    pthread_cond_destroy(&heap->finalizable);
+    pthread_mutex_destroy(&heap->lock);
+    free(heap);
 }
 
-struct Object *get_element(struct Object *array, int index)
+/*
+ * Puts a piece of memory onto the free list of its size class.
+ */
+void release(struct VM *vm, void *memory, size_t size)
 {
-    return array->array[index];
+    if (size > SMALL_OBJECT_LIMIT)
+    {
+        munmap(memory, size);
+        return;
+    }
+    if (!vm)
+    {
+        return;
+    }
+    *(void **)memory = vm->free_lists[size / ALIGNMENT];
+    vm->free_lists[size / ALIGNMENT] = memory;
 }
 
-void set_element(struct Object *array, int index, struct Object *element)
+/*
+ * Puts what is left of the TLAB onto the free lists, in pieces no larger than
+ * SMALL_OBJECT_LIMIT.
+ */
+void release_tlab(struct VM *vm)
 {
-    array->array[index] = element;
+    size_t size;
+    while (vm->tlab_top < vm->tlab_end)
+    {
+        size = vm->tlab_end - vm->tlab_top;
+        size = size < SMALL_OBJECT_LIMIT ? size : SMALL_OBJECT_LIMIT;
+        release(vm, vm->tlab_top, size);
+        vm->tlab_top += size;
+    }
 }
 
 /*
- * Functions that print objects in a human readable form. Pairs are printed in a
- * lisp-like fashion.
+ * The slow path of allocation, taken when there is no free memory of the
+ * requested size left in the thread. Before taking a new TLAB from the heap,
+ * we look for memory that other threads gave back to it.
  */
-void print_array(struct Object *);
-void print_object(struct Object *);
-
-void print_array(struct Object *array)
+__attribute__((noinline))
+void *allocate_slowly(struct VM *vm, size_t size)
 {
-    int i;
-    putchar('[');
-    for (i = 0; i < array->length; i++)
+    struct Heap *heap = vm->heap;
+    struct Page *page;
+    void *memory;
+    release_tlab(vm);
+    pthread_mutex_lock(&heap->lock);
+    if (heap->free_lists[size / ALIGNMENT])
     {
-        if (i > 0)
-        {
-            fputs(", ", stdout);
-        }
-        print_object(array->array[i]);
+        memory = heap->free_lists[size / ALIGNMENT];
+        heap->free_lists[size / ALIGNMENT] = NULL;
+        pthread_mutex_unlock(&heap->lock);
+        vm->free_lists[size / ALIGNMENT] = *(void **)memory;
+        return memory;
+    }
+    if (heap->page_top + TLAB_SIZE > heap->page_end)
+    {
+        page = malloc(HEAP_PAGE_SIZE);
+        page->next = heap->pages;
+        heap->pages = page;
+        heap->page_top = (char *)page + ALIGNMENT;
+        heap->page_end = (char *)page + HEAP_PAGE_SIZE;
     }
-    putchar(']');
+    vm->tlab_top = heap->page_top;
+    vm->tlab_end = heap->page_top + TLAB_SIZE;
+    heap->page_top += TLAB_SIZE;
+    pthread_mutex_unlock(&heap->lock);
+    memory = vm->tlab_top;
+    vm->tlab_top += size;
+    return memory;
 }
 
-void print_object(struct Object *object)
+/*
+ * The fast path of allocation only touches the thread's own free lists and
+ * TLAB, so it needs neither locks nor atomic instructions.
+ */
+void *allocate(struct VM *vm, size_t size)
 {
-    if (object)
+    void *memory;
+    size = (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    if (vm->free_lists[size / ALIGNMENT])
     {
-        switch (object->type)
-        {
-            case ARRAY:
-                print_array(object);
-                break;
-            case NUMBER:
-                printf("%g", object->number);
-                break;
-            case PAIR:
-                putchar('(');
-                print_object(object->head);
-                object = object->tail;
-                while (object && object->type == PAIR)
-                {
-                    putchar(' ');
-                    print_object(object->head);
-                    object = object->tail;
-                }
-                if (object)
-                {
-                    fputs(" . ", stdout);
-                    print_object(object->tail);
-                }
-                putchar(')');
-                break;
-            case STRING:
-                putchar('"');
-                fputs(object->string, stdout);
-                putchar('"');
-                break;
-        }
+        memory = vm->free_lists[size / ALIGNMENT];
+        vm->free_lists[size / ALIGNMENT] = *(void **)memory;
+        return memory;
     }
-    else
+    if (vm->tlab_top + size <= vm->tlab_end)
     {
-        fputs("null", stdout);
+        memory = vm->tlab_top;
+        vm->tlab_top += size;
+        return memory;
     }
+    return allocate_slowly(vm, size);
 }
 
 /*
- * We implement a little stack that could be part of a virtual machine.
+ * Returns the number of bytes allocated for an object, rounded up to a
+ * multiple of ALIGNMENT.
  */
-struct Object *stack[STACK_SIZE];
-int stack_length = 0;
+size_t object_size(struct Object *object)
+{
+    size_t size = sizeof(struct Object);
+    switch (object->type)
+    {
+        case ARRAY:
+            size += object->inline_size * sizeof(struct Object *);
+            break;
+        case ELEMENTS:
+            size = offsetof(struct Object, elements) + object->element_capacity * sizeof(struct Object *);
+            break;
+        case LIST:
+            size = offsetof(struct Object, heads) + object->list_length * sizeof(struct Object *);
+            break;
+        case STRING:
+            size = offsetof(struct Object, characters) + object->string_length + 1;
+            break;
+        default:
+            break;
+    }
+    return (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
 
-void push(struct Object *object)
+/*
+ * If several threads share a heap, the garbage collector has to stop all of
+ * them before it may look at the heap; otherwise they would change objects and
+ * stacks under its feet. It can't just suspend threads wherever they are,
+ * since they might be halfway through changing an object. Instead every thread
+ * regularly checks whether a collection has been requested, at so-called
+ * safepoints: before every instruction it interprets and before every
+ * allocation. The time a thread needs to reach a safepoint is therefore
+ * bounded by the longest single instruction.
+ *
+ * At a safepoint a thread parks until the collection is over. The collector
+ * waits until all other threads of the heap are parked, then marks from all
+ * their stacks, which is why every virtual machine registers with its heap.
+ * Threads that are about to do something else for a while, e.g. wait for
+ * input, can enter a safe region, promising not to touch the heap until they
+ * leave it, so that the collector doesn't have to wait for them.
+ *
+ * These functions must be called with the heap's lock held.
+ */
+void park(struct VM *vm)
 {
-    stack[stack_length] = object;
-    stack_length++;
+    vm->heap->stopped_count++;
+    pthread_cond_signal(&vm->heap->stopped);
+    while (atomic_load(&vm->heap->safepoint_requested))
+    {
+        pthread_cond_wait(&vm->heap->resumed, &vm->heap->lock);
+    }
+    vm->heap->stopped_count--;
 }
 
-struct Object *pop(void)
+void attach(struct VM *vm)
 {
-    stack_length--;
-    return stack[stack_length];
+    while (atomic_load(&vm->heap->safepoint_requested))
+    {
+        pthread_cond_wait(&vm->heap->resumed, &vm->heap->lock);
+    }
+    vm->next_mutator = vm->heap->mutators;
+    vm->heap->mutators = vm;
+    vm->heap->mutator_count++;
 }
 
-struct Object *peek(void)
+void detach(struct VM *vm)
 {
-    return stack[stack_length - 1];
+    struct VM **mutator = &vm->heap->mutators;
+    while (atomic_load(&vm->heap->safepoint_requested))
+    {
+        park(vm);
+    }
+    while (*mutator != vm)
+    {
+        mutator = &(*mutator)->next_mutator;
+    }
+    *mutator = vm->next_mutator;
+    vm->heap->mutator_count--;
 }
 
 /*
- * Our garbage collector will have to mark reachable objects. However if a
- * reachable object is a data structure, then its elements must also be marked.
- * If they are also data structures, then their elements must also be marked and
- * so on. Thus we need a recursive function.
- *
- * Cyclical references could lead to an infinite recursion. To avoid this, we
- * won't mark objects already marked.
+ * The functions for threads to call.
  */
-void mark_elements(struct Object *);
-void mark_object(struct Object *);
+__attribute__((cold, noinline))
+void safepoint(struct VM *vm)
+{
+    pthread_mutex_lock(&vm->heap->lock);
+    park(vm);
+    pthread_mutex_unlock(&vm->heap->lock);
+}
 
-void mark_elements(struct Object *array)
+void poll_safepoint(struct VM *vm)
 {
-    int i;
-    for (i = 0; i < array->length; i++)
+    if (__builtin_expect(atomic_load_explicit(&vm->heap->safepoint_requested, memory_order_relaxed), 0))
     {
-        mark_object(array->array[i]);
+        safepoint(vm);
     }
 }
 
-void mark_object(struct Object *object)
+void enter_safe_region(struct VM *vm)
 {
-    if (object && !object->mark)
+    pthread_mutex_lock(&vm->heap->lock);
+    vm->heap->stopped_count++;
+    pthread_cond_signal(&vm->heap->stopped);
+    pthread_mutex_unlock(&vm->heap->lock);
+}
+
+void leave_safe_region(struct VM *vm)
+{
+    pthread_mutex_lock(&vm->heap->lock);
+    while (atomic_load(&vm->heap->safepoint_requested))
     {
-        object->mark = 1;
-        switch (object->type)
-        {
-            case ARRAY:
-                mark_elements(object);
-                break;
-            case NUMBER:
-                break;
-            case PAIR:
-                mark_object(object->head);
-                mark_object(object->tail);
-                break;
-            case STRING:
-                break;
-        }
+        pthread_cond_wait(&vm->heap->resumed, &vm->heap->lock);
     }
+    vm->heap->stopped_count--;
+    pthread_mutex_unlock(&vm->heap->lock);
 }
 
 /*
- * A function that marks all objects on the stack or reachable from the stack.
+ * Objects larger than SMALL_OBJECT_LIMIT, i.e. long strings and the elements of
+ * large arrays, make up the large object space. Each of them is mapped from
+ * the operating system on its own, never moves, and is unmapped as soon as it
+ * is deleted, which gives the memory back right away. They are chained together
+ * in a list of their own in the heap, so that sweeping them only visits large
+ * objects.
  */
-void mark(void)
+void flush_output(struct VM *);
+
+__attribute__((cold, noinline))
+void out_of_memory(struct VM *vm)
 {
-    int i;
-    for (i = 0; i < stack_length; i++)
-    {
-        mark_object(stack[i]);
-    }
+    flush_output(vm);
+    fputs("Out of memory\n", stderr);
+    exit(EXIT_FAILURE);
 }
 
 /*
- * After calling mark() all reachable objects are marked. Now we need a function
- * to go through the linked list, unchain unmarked objects and free them. If we
- * encounter a marked object, we will just remove the mark for the next GC
- * cycle.
- *
- * Nystrom uses a cool trick with a pointer to a pointer here, which is awesome
- * but also difficult to understand. I go for a more readable approach with an
- * extra variable "previous".
+ * If asked to, huge objects, of HUGE_OBJECT_LIMIT bytes or more, ask for huge
+ * pages where the system has them, so that scanning them takes fewer TLB
+ * misses. It is optional since huge pages may take the kernel time to find
+ * and may waste memory that a heap with many huge objects can't spare.
  */
-void sweep(void)
+void advise_huge_pages(struct Heap *heap, void *memory, size_t size)
 {
-    struct Object *object = list_of_objects;
-    struct Object *previous = NULL;
-    struct Object *garbage;
-    while (object)
+#ifdef MADV_HUGEPAGE
+    if (heap->huge_pages && size >= HUGE_OBJECT_LIMIT)
     {
-        if (object->mark)
-        {
-            fputs("I won't delete this: ", stdout);
-            print_object(object);
-            putchar('\n');
-            object->mark = 0;
-            previous = object;
-            object = object->next;
-        }
-        else
-        {
-            fputs("I will delete this: ", stdout);
-            print_object(object);
-            putchar('\n');
-            if (previous)
-            {
-                previous->next = object->next;
-            }
-            else
-            {
-                list_of_objects = object->next;
-            }
-            garbage = object;
-            object = object->next;
-            delete_object(garbage);
-        }
+        madvise(memory, size, MADV_HUGEPAGE);
     }
+#else
+    (void)heap;
+    (void)memory;
+    (void)size;
+#endif
+}
+
+void set_huge_pages(struct Heap *heap, int enabled)
+{
+    heap->huge_pages = enabled;
 }
 
-void stop_the_world_mark_and_sweep(void)
+struct Object *new_large_object(struct VM *vm, size_t size)
 {
-    mark();
-    sweep();
+    struct Object *object = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (object == MAP_FAILED)
+    {
+        out_of_memory(vm);
+    }
+    advise_huge_pages(vm->heap, object, size);
+    object->mark = 0;
+    object->interned = 0;
+    object->age = 0;
+    pthread_mutex_lock(&vm->heap->lock);
+    object->next = vm->heap->large_objects;
+    vm->heap->large_objects = object;
+    pthread_mutex_unlock(&vm->heap->lock);
+    return object;
 }
 
 /*
- * Now let's implement a simple stack-oriented language with the following
- * features:
- * - literal numbers are pushed onto the stack.
- * - "add", "sub", "mul", "div" and "mod" pop two operands from the stack,
- *   perform an arithmetic operation and push the result onto the stack.
- * - "pop" pops a value from the stack.
- * - "print" prints the top of the stack without popping it.
- * - "null" pushes a null pointer onto the stack.
- * - "cons" pops two values from the stack, constructs a pair and pushes it onto
- *   the stack.
- *
- * This language lacks support for strings and arrays even though our type
- * system includes them, but you can always expand the language if you like.
+ * This function creates a new object and adds it to the linked list. Don't use
+ * this function directly, call the type specific functions instead.
  */
-enum TokenType
+struct Object *new_object_of_size(struct VM *vm, size_t size)
 {
-    ADD_TOKEN,
-    CONS_TOKEN,
-    DIV_TOKEN,
-    END_TOKEN,
-    MOD_TOKEN,
-    MUL_TOKEN,
-    NULL_TOKEN,
-    NUMBER_TOKEN,
-    POP_TOKEN,
-    PRINT_TOKEN,
-    SUB_TOKEN
-};
+    struct Object *object;
+    poll_safepoint(vm);
+    if (size > SMALL_OBJECT_LIMIT)
+    {
+        return new_large_object(vm, size);
+    }
+    object = allocate(vm, size);
+    object->mark = 0;
+    object->interned = 0;
+    object->age = 0;
+    object->next = vm->list_of_objects;
+    vm->list_of_objects = object;
+    return object;
+}
 
-struct Token
+struct Object *new_object(struct VM *vm)
 {
-    enum TokenType type;
+    return new_object_of_size(vm, sizeof(struct Object));
+}
+
+void push(struct VM *, struct Object *);
+struct Object *pop(struct VM *);
+
+/*
+ * Each array object has a pointer to its elements, which are either part of
+ * the object itself or of an elements object. An array too large to keep its
+ * elements inline gets an elements object right away, allocated first and kept
+ * on the stack while the array is allocated, so that it stays reachable.
+ */
+struct Object *new_elements(struct VM *vm, int size)
+{
+    struct Object *object = new_object_of_size(vm, offsetof(struct Object, elements) + size * sizeof(struct Object *));
+    object->type = ELEMENTS;
+    object->element_capacity = size;
+    return object;
+}
+
+struct Object **inline_elements(struct Object *array)
+{
+    return (struct Object **)(array + 1);
+}
+
+struct Object *elements_of(struct Object *array)
+{
+    if (array->array == inline_elements(array))
+    {
+        return NULL;
+    }
+    return (struct Object *)((char *)array->array - offsetof(struct Object, elements));
+}
+
+struct Object *new_array_of_size(struct VM *vm, int size)
+{
+    struct Object *object;
+    struct Object *elements;
+    size = size > 0 ? size : 1;
+    if (size <= MAXIMUM_INLINE_ARRAY_SIZE)
+    {
+        object = new_object_of_size(vm, sizeof(struct Object) + size * sizeof(struct Object *));
+        object->inline_size = size;
+        object->array = inline_elements(object);
+    }
+    else
+    {
+        elements = new_elements(vm, size);
+        push(vm, elements);
+        object = new_object(vm);
+        pop(vm);
+        object->inline_size = 0;
+        object->array = elements->elements;
+    }
+    object->type = ARRAY;
+    object->length = 0;
+    object->size = size;
+    return object;
+}
+
+struct Object *new_array(struct VM *vm)
+{
+    return new_array_of_size(vm, MAXIMUM_INLINE_ARRAY_SIZE);
+}
+
+/*
+ * The doubles of a float array are aligned to 32 bytes so that SIMD
+ * instructions can load four of them at once.
+ */
+struct Object *new_float_array(struct VM *vm, int length)
+{
+    struct Object *object = new_object(vm);
+    size_t size = (length * sizeof(double) + FLOAT_ALIGNMENT - 1) / FLOAT_ALIGNMENT * FLOAT_ALIGNMENT;
+    object->type = FLOAT_ARRAY;
+    object->length = length;
+    object->size = length;
+    object->floats = aligned_alloc(FLOAT_ALIGNMENT, size ? size : FLOAT_ALIGNMENT);
+    return object;
+}
+
+/*
+ * Small integers like 0, 1 and -1 are needed all the time, so every heap
+ * creates a number object for each integer from MINIMUM_SMALL_INTEGER to
+ * MAXIMUM_SMALL_INTEGER up front, and new_number() returns those instead of
+ * allocating. They are immortal: they are on no list of objects, so they are
+ * never swept, and they are marked for good, so that marking stops at them
+ * and weak references to them are never cleared. -0 is not cached, since it
+ * prints differently from 0.
+ */
+int is_small_integer(double number)
+{
+    return number >= MINIMUM_SMALL_INTEGER && number <= MAXIMUM_SMALL_INTEGER && number == (int)number && !(number == 0 && signbit(number));
+}
+
+struct Object *new_number(struct VM *vm, double number)
+{
+    struct Object *object;
+    if (is_small_integer(number))
+    {
+        return &vm->heap->small_integers[(int)number - MINIMUM_SMALL_INTEGER];
+    }
+    object = new_object(vm);
+    object->type = NUMBER;
+    object->number = number;
+    return object;
+}
+
+struct Object *new_pair(struct VM *vm, struct Object *head, struct Object *tail)
+{
+    struct Object *object = new_object(vm);
+    object->type = PAIR;
+    object->head = head;
+    object->tail = tail;
+    return object;
+}
+
+/*
+ * Lists built in one go, like "1 2 3 null cons cons cons", are stored the way
+ * Lisp machines "CDR-coded" them: instead of a chain of pairs, one object
+ * holds all the heads side by side, and only the tail of the last pair is
+ * stored, since every other tail is simply the rest of the run. A list of n
+ * elements then takes 8 bytes per element instead of a 32 byte pair, and
+ * marking or printing it scans the heads in order instead of chasing tails.
+ *
+ * The pairs of a list are not objects of their own, so nothing can point into
+ * the middle of it. That is fine as long as pairs are never changed; a pair
+ * that could be would have to be a real one.
+ */
+struct Object *new_list(struct VM *vm, struct Object **heads, int length, struct Object *tail)
+{
+    struct Object *object;
+    if (length == 0)
+    {
+        return tail;
+    }
+    object = new_object_of_size(vm, offsetof(struct Object, heads) + length * sizeof(struct Object *));
+    object->type = LIST;
+    object->list_length = length;
+    object->list_tail = tail;
+    memcpy(object->heads, heads, length * sizeof(struct Object *));
+    return object;
+}
+
+struct Object *new_string_of_length(struct VM *vm, char *characters, int length)
+{
+    struct Object *object = new_object_of_size(vm, offsetof(struct Object, characters) + length + 1);
+    object->type = STRING;
+    object->string_length = length;
+    memcpy(object->characters, characters, length);
+    object->characters[length] = '\0';
+    return object;
+}
+
+struct Object *new_string(struct VM *vm, char *string)
+{
+    return new_string_of_length(vm, string, strlen(string));
+}
+
+struct Object *new_weak_ref(struct VM *vm, struct Object *target)
+{
+    struct Object *object = new_object(vm);
+    object->type = WEAK_REF;
+    object->target = target;
+    return object;
+}
+
+/*
+ * A function to delete objects. Never call this function directly, as it will
+ * not properly unchain the object from the linked list. Call the garbage
+ * collector instead and let it do all the clean-up.
+ *
+ * Note that elements of data structures are not deleted recursively. The might
+ * still be referenced from somewhere else and we'll leave it to the garbage
+ * collector to figure that out.
+ */
+void delete_object(struct VM *vm, struct Object *object)
+{
+    if (object)
+    {
+        switch (object->type)
+        {
+            case ARRAY:
+                break;
+            case ELEMENTS:
+                break;
+            case EPHEMERON_TABLE:
+                free(object->table);
+                break;
+            case FLOAT_ARRAY:
+                free(object->floats);
+                break;
+            case LIST:
+                break;
+            case MAP:
+                free(object->table);
+                break;
+            case NUMBER:
+                break;
+            case PAIR:
+                break;
+            case STRING:
+                break;
+            case WEAK_REF:
+                break;
+        }
+        release(vm, object, object_size(object));
+    }
+}
+
+/*
+ * Functions for array operations.
+ *
+ * Resizing an array moves its elements back into the array object if they fit
+ * there, and into a new elements object otherwise, leaving the old one to the
+ * garbage collector. Arrays must be reachable when calling functions that may
+ * resize them, since allocating may collect garbage. Elements taken out of an
+ * array or about to be put in are kept on the stack meanwhile.
+ *
+ * A full array doubles its size. An array that is only a quarter full halves
+ * it, perhaps several times, so that it is half full again afterwards. The gap
+ * between the two keeps an array from being resized over and over when
+ * elements are appended and removed in turn.
+ */
+#ifdef MREMAP_MAYMOVE
+/*
+ * Huge elements objects grow with mremap() instead, which moves their pages
+ * to a larger mapping rather than copying the elements. The elements object
+ * may end up at another address, so we relink it in the list of large objects.
+ */
+void grow_huge_elements(struct VM *vm, struct Object *array, int size)
+{
+    struct Heap *heap = vm->heap;
+    struct Object *elements = elements_of(array);
+    struct Object **link = &heap->large_objects;
+    size_t new_size = offsetof(struct Object, elements) + size * sizeof(struct Object *);
+    pthread_mutex_lock(&heap->lock);
+    while (*link != elements)
+    {
+        link = &(*link)->next;
+    }
+    elements = mremap(elements, object_size(elements), new_size, MREMAP_MAYMOVE);
+    if (elements == MAP_FAILED)
+    {
+        pthread_mutex_unlock(&heap->lock);
+        out_of_memory(vm);
+    }
+    *link = elements;
+    pthread_mutex_unlock(&heap->lock);
+    advise_huge_pages(heap, elements, new_size);
+    elements->element_capacity = size;
+    array->array = elements->elements;
+    array->size = size;
+}
+#endif
+
+void resize_array(struct VM *vm, struct Object *array, int size)
+{
+    struct Object *elements;
+#ifdef MREMAP_MAYMOVE
+    elements = elements_of(array);
+    if (elements && size > array->size && object_size(elements) >= HUGE_OBJECT_LIMIT)
+    {
+        grow_huge_elements(vm, array, size);
+        return;
+    }
+#endif
+    if (size <= array->inline_size)
+    {
+        memmove(inline_elements(array), array->array, array->length * sizeof(struct Object *));
+        array->array = inline_elements(array);
+        array->size = array->inline_size;
+        return;
+    }
+    elements = new_elements(vm, size);
+    memcpy(elements->elements, array->array, array->length * sizeof(struct Object *));
+    array->array = elements->elements;
+    array->size = size;
+}
+
+__attribute__((cold, noinline))
+void grow_array(struct VM *vm, struct Object *array, struct Object *element)
+{
+    push(vm, element);
+    resize_array(vm, array, array->size * 2);
+    pop(vm);
+}
+
+void shrink_array(struct VM *vm, struct Object *array)
+{
+    int size = array->size;
+    while (size > MAXIMUM_INLINE_ARRAY_SIZE && array->length <= size / 4)
+    {
+        size /= 2;
+    }
+    if (size < array->size)
+    {
+        resize_array(vm, array, size);
+    }
+}
+
+void reserve_elements(struct VM *vm, struct Object *array, int size)
+{
+    if (size > array->size)
+    {
+        resize_array(vm, array, size);
+    }
+}
+
+void append_element(struct VM *vm, struct Object *array, struct Object *element)
+{
+    if (array->length == array->size)
+    {
+        grow_array(vm, array, element);
+    }
+    array->array[array->length] = element;
+    array->length++;
+}
+
+/*
+ * Appends all elements of another array, which may be the array itself.
+ */
+void append_elements(struct VM *vm, struct Object *array, struct Object *other)
+{
+    int length = other->length;
+    if (array->length + length > array->size)
+    {
+        resize_array(vm, array, array->length + length > 2 * array->size ? array->length + length : 2 * array->size);
+    }
+    memcpy(array->array + array->length, other->array, length * sizeof(struct Object *));
+    array->length += length;
+}
+
+/*
+ * Removes the element at the given index and returns it, or NULL if there is
+ * no such element.
+ */
+struct Object *remove_element(struct VM *vm, struct Object *array, int index)
+{
+    struct Object *element;
+    if (index < 0 || index >= array->length)
+    {
+        return NULL;
+    }
+    element = array->array[index];
+    memmove(array->array + index, array->array + index + 1, (array->length - index - 1) * sizeof(struct Object *));
+    array->length--;
+    push(vm, element);
+    shrink_array(vm, array);
+    return pop(vm);
+}
+
+struct Object *pop_element(struct VM *vm, struct Object *array)
+{
+    return remove_element(vm, array, array->length - 1);
+}
+
+void truncate_array(struct VM *vm, struct Object *array, int length)
+{
+    if (length >= 0 && length < array->length)
+    {
+        array->length = length;
+        shrink_array(vm, array);
+    }
+}
+
+/*
+ * Returns a new array of the elements from index "start" up to, but not
+ * including, index "end", clamped to the bounds of the array.
+ */
+struct Object *slice_array(struct VM *vm, struct Object *array, int start, int end)
+{
+    struct Object *slice;
+    start = start < 0 ? 0 : start;
+    end = end > array->length ? array->length : end;
+    end = end < start ? start : end;
+    slice = new_array_of_size(vm, end - start);
+    memcpy(slice->array, array->array + start, (end - start) * sizeof(struct Object *));
+    slice->length = end - start;
+    return slice;
+}
+
+/*
+ * Returns a new array of the elements of the first array followed by those of
+ * the second. Both arrays must be reachable.
+ */
+struct Object *concat_arrays(struct VM *vm, struct Object *first, struct Object *second)
+{
+    struct Object *result = new_array_of_size(vm, first->length + second->length);
+    memcpy(result->array, first->array, first->length * sizeof(struct Object *));
+    memcpy(result->array + first->length, second->array, second->length * sizeof(struct Object *));
+    result->length = first->length + second->length;
+    return result;
+}
+
+struct Object *get_element(struct Object *array, int index)
+{
+    return array->array[index];
+}
+
+void set_element(struct Object *array, int index, struct Object *element)
+{
+    array->array[index] = element;
+}
+
+struct Object *weak_ref_target(struct Object *weak_ref)
+{
+    return weak_ref->target;
+}
+
+/*
+ * A map is a hash table with open addressing, in the style of Google's Swiss
+ * tables. Its keys and values are stored side by side in slots, and each slot
+ * has a control byte: MAP_EMPTY, MAP_DELETED, or the lowest 7 bits of the hash
+ * of the key in the slot. The slots are probed in groups of MAP_GROUP_SIZE.
+ * All control bytes of a group are compared with the hash bits at once, using
+ * SSE2 where available, and only keys whose control bytes match are compared
+ * themselves. A group with an empty slot ends the search. Groups are probed in
+ * triangular order, which visits all of them since their number is a power of
+ * two.
+ *
+ * Numbers are equal keys if they are equal numbers or the same NaN, and strings
+ * if they have the same characters. Other keys are only equal to themselves. A map is at
+ * most 7/8 full, counting deleted slots, so every search ends at an empty
+ * slot.
+ *
+ * Ephemeron tables are tables of the same kind, but all their keys are only
+ * equal to themselves and hashed by address.
+ */
+struct MapTable
+{
+    int deleted;
+    struct Object **slots;
+    unsigned char control[];
+};
+
+struct MapTable *new_map_table(int size)
+{
+    struct MapTable *table = malloc(sizeof(struct MapTable) + size + 2 * size * sizeof(struct Object *));
+    table->deleted = 0;
+    table->slots = (struct Object **)(table->control + size);
+    memset(table->control, MAP_EMPTY, size);
+    return table;
+}
+
+struct Object *new_map_of_type(struct VM *vm, enum Type type)
+{
+    struct Object *object = new_object(vm);
+    object->type = type;
+    object->length = 0;
+    object->size = INITIAL_MAP_SIZE;
+    object->table = new_map_table(INITIAL_MAP_SIZE);
+    return object;
+}
+
+struct Object *new_map(struct VM *vm)
+{
+    return new_map_of_type(vm, MAP);
+}
+
+struct Object *new_ephemeron_table(struct VM *vm)
+{
+    return new_map_of_type(vm, EPHEMERON_TABLE);
+}
+
+uint64_t mix_hash(uint64_t hash)
+{
+    hash *= 0x9e3779b97f4a7c15u;
+    return hash ^ hash >> 32;
+}
+
+uint64_t hash_characters(char *characters, int length)
+{
+    uint64_t hash = 14695981039346656037u;
+    int i;
+    for (i = 0; i < length; i++)
+    {
+        hash = (hash ^ (unsigned char)characters[i]) * 1099511628211u;
+    }
+    return mix_hash(hash);
+}
+
+/*
+ * Number keys are compared by their bits, after adding 0 to turn -0 into 0.
+ * Equal numbers then have the same bits, and so does a NaN with itself, which
+ * it would not be equal to as a number, so NaN keys can be found again.
+ */
+uint64_t number_key(double number)
+{
+    uint64_t bits;
+    number += 0.0;
+    memcpy(&bits, &number, sizeof(bits));
+    return bits;
+}
+
+uint64_t hash_key(struct Object *key)
+{
+    uint64_t hash = (uintptr_t)key;
+    if (key && key->type == STRING)
+    {
+        return hash_characters(key->characters, key->string_length);
+    }
+    if (key && key->type == NUMBER)
+    {
+        hash = number_key(key->number);
+    }
+    return mix_hash(hash);
+}
+
+uint64_t hash_map_key(struct Object *map, struct Object *key)
+{
+    if (map->type == EPHEMERON_TABLE)
+    {
+        return mix_hash((uintptr_t)key);
+    }
+    return hash_key(key);
+}
+
+int equal_keys(struct Object *key1, struct Object *key2)
+{
+    if (key1 == key2)
+    {
+        return 1;
+    }
+    if (!key1 || !key2 || key1->type != key2->type || (key1->interned && key2->interned))
+    {
+        return 0;
+    }
+    switch (key1->type)
+    {
+        case NUMBER:
+            return number_key(key1->number) == number_key(key2->number);
+        case STRING:
+            return key1->string_length == key2->string_length && memcmp(key1->characters, key2->characters, key1->string_length) == 0;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Returns a bit mask of the control bytes of a group equal to the given byte,
+ * or of the free ones, i.e. those with the highest bit set.
+ */
+unsigned match_control(unsigned char *control, unsigned char byte)
+{
+#ifdef SIMD
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)control), _mm_set1_epi8(byte)));
+#else
+    unsigned mask = 0;
+    int i;
+    for (i = 0; i < MAP_GROUP_SIZE; i++)
+    {
+        mask |= (unsigned)(control[i] == byte) << i;
+    }
+    return mask;
+#endif
+}
+
+unsigned match_free(unsigned char *control)
+{
+#ifdef SIMD
+    return _mm_movemask_epi8(_mm_loadu_si128((__m128i *)control));
+#else
+    unsigned mask = 0;
+    int i;
+    for (i = 0; i < MAP_GROUP_SIZE; i++)
+    {
+        mask |= (unsigned)(control[i] >> 7) << i;
+    }
+    return mask;
+#endif
+}
+
+/*
+ * Returns the slot holding the key, or -1 if there is none.
+ */
+int find_in_map(struct Object *map, struct Object *key, uint64_t hash)
+{
+    int groups = map->size / MAP_GROUP_SIZE;
+    int group = (hash >> 7) & (groups - 1);
+    int step = 0;
+    unsigned char *control;
+    unsigned mask;
+    int i;
+    while (1)
+    {
+        control = map->table->control + group * MAP_GROUP_SIZE;
+        for (mask = match_control(control, hash & 0x7f); mask; mask &= mask - 1)
+        {
+            i = group * MAP_GROUP_SIZE + __builtin_ctz(mask);
+            if (map->table->slots[2 * i] == key || (map->type == MAP && equal_keys(map->table->slots[2 * i], key)))
+            {
+                return i;
+            }
+        }
+        if (match_control(control, MAP_EMPTY))
+        {
+            return -1;
+        }
+        step++;
+        group = (group + step) & (groups - 1);
+    }
+}
+
+/*
+ * Returns the first empty or deleted slot where a key could go.
+ */
+int find_free_slot(struct MapTable *table, int size, uint64_t hash)
+{
+    int groups = size / MAP_GROUP_SIZE;
+    int group = (hash >> 7) & (groups - 1);
+    int step = 0;
+    unsigned mask;
+    while (1)
+    {
+        mask = match_free(table->control + group * MAP_GROUP_SIZE);
+        if (mask)
+        {
+            return group * MAP_GROUP_SIZE + __builtin_ctz(mask);
+        }
+        step++;
+        group = (group + step) & (groups - 1);
+    }
+}
+
+/*
+ * Moves all entries into a new table of the given size, which also gets rid of
+ * deleted slots.
+ */
+void rehash_map(struct Object *map, int size)
+{
+    struct MapTable *table = new_map_table(size);
+    uint64_t hash;
+    int i;
+    int j;
+    for (i = 0; i < map->size; i++)
+    {
+        if (map->table->control[i] < MAP_EMPTY)
+        {
+            hash = hash_map_key(map, map->table->slots[2 * i]);
+            j = find_free_slot(table, size, hash);
+            table->control[j] = hash & 0x7f;
+            table->slots[2 * j] = map->table->slots[2 * i];
+            table->slots[2 * j + 1] = map->table->slots[2 * i + 1];
+        }
+    }
+    free(map->table);
+    map->table = table;
+    map->size = size;
+}
+
+struct Object *get_from_map(struct Object *map, struct Object *key)
+{
+    int i = find_in_map(map, key, hash_map_key(map, key));
+    return i < 0 ? NULL : map->table->slots[2 * i + 1];
+}
+
+/*
+ * A map that would get more than 7/8 full doubles its size, or only gets rid
+ * of its deleted slots if they are what fills it up.
+ */
+void set_in_map(struct Object *map, struct Object *key, struct Object *value)
+{
+    uint64_t hash = hash_map_key(map, key);
+    int i = find_in_map(map, key, hash);
+    if (i >= 0)
+    {
+        map->table->slots[2 * i + 1] = value;
+        return;
+    }
+    if (8 * (map->length + map->table->deleted + 1) > 7 * map->size)
+    {
+        rehash_map(map, 16 * (map->length + 1) > 7 * map->size ? 2 * map->size : map->size);
+    }
+    i = find_free_slot(map->table, map->size, hash);
+    if (map->table->control[i] == MAP_DELETED)
+    {
+        map->table->deleted--;
+    }
+    map->table->control[i] = hash & 0x7f;
+    map->table->slots[2 * i] = key;
+    map->table->slots[2 * i + 1] = value;
+    map->length++;
+}
+
+/*
+ * Removes a key and returns its value. If the group of the slot has an empty
+ * slot, no search ever went past this group, so the slot can be marked empty
+ * rather than deleted.
+ */
+void remove_slot(struct Object *map, int i)
+{
+    if (match_control(map->table->control + i / MAP_GROUP_SIZE * MAP_GROUP_SIZE, MAP_EMPTY))
+    {
+        map->table->control[i] = MAP_EMPTY;
+    }
+    else
+    {
+        map->table->control[i] = MAP_DELETED;
+        map->table->deleted++;
+    }
+    map->length--;
+}
+
+struct Object *remove_from_map(struct Object *map, struct Object *key)
+{
+    int i = find_in_map(map, key, hash_map_key(map, key));
+    if (i < 0)
+    {
+        return NULL;
+    }
+    remove_slot(map, i);
+    return map->table->slots[2 * i + 1];
+}
+
+/*
+ * Looking up a key that isn't in an ephemeron table gives NULL.
+ */
+struct Object *get_ephemeron(struct Object *table, struct Object *key)
+{
+    return get_from_map(table, key);
+}
+
+void set_ephemeron(struct Object *table, struct Object *key, struct Object *value)
+{
+    set_in_map(table, key, value);
+}
+
+/*
+ * Interned strings are kept in a hash table of the heap, so that no two of them
+ * have the same characters and they can be compared by identity, as maps do.
+ * Interning a string that is already there gives the existing object instead
+ * of a new copy.
+ *
+ * The table holds its strings weakly. After marking, the garbage collector
+ * drops the unmarked ones from it before they are deleted, rebuilding the
+ * table without them, so there is never a deleted entry to skip. It is probed
+ * linearly and kept at most half full.
+ */
+struct Object *find_string(struct ObjectTable *table, char *characters, int length, uint64_t hash)
+{
+    struct Object *string;
+    int i;
+    if (!table->objects)
+    {
+        return NULL;
+    }
+    for (i = hash & (table->size - 1); (string = table->objects[i]); i = (i + 1) & (table->size - 1))
+    {
+        if (string->string_length == length && memcmp(string->characters, characters, length) == 0)
+        {
+            return string;
+        }
+    }
+    return NULL;
+}
+
+uint64_t hash_pair(struct Object *head, struct Object *tail)
+{
+    return mix_hash(hash_key(head) ^ hash_key(tail) >> 1);
+}
+
+int identical_values(struct Object *value1, struct Object *value2)
+{
+    if (value1 && value2 && value1->type == NUMBER && value2->type == NUMBER)
+    {
+        return memcmp(&value1->number, &value2->number, sizeof(double)) == 0;
+    }
+    return equal_keys(value1, value2);
+}
+
+struct Object *find_pair(struct ObjectTable *table, struct Object *head, struct Object *tail)
+{
+    struct Object *pair;
+    int i;
+    if (!table->objects)
+    {
+        return NULL;
+    }
+    for (i = hash_pair(head, tail) & (table->size - 1); (pair = table->objects[i]); i = (i + 1) & (table->size - 1))
+    {
+        if (identical_values(pair->head, head) && identical_values(pair->tail, tail))
+        {
+            return pair;
+        }
+    }
+    return NULL;
+}
+
+void insert_object(struct ObjectTable *table, struct Object *object)
+{
+    int i = (object->type == PAIR ? hash_pair(object->head, object->tail) : hash_key(object)) & (table->size - 1);
+    while (table->objects[i])
+    {
+        i = (i + 1) & (table->size - 1);
+    }
+    table->objects[i] = object;
+    table->count++;
+}
+
+void rehash_objects(struct ObjectTable *table, int size)
+{
+    struct Object **objects = table->objects;
+    int old_size = table->size;
+    int i;
+    table->objects = calloc(size, sizeof(struct Object *));
+    table->size = size;
+    table->count = 0;
+    for (i = 0; i < old_size; i++)
+    {
+        if (objects[i])
+        {
+            insert_object(table, objects[i]);
+        }
+    }
+    free(objects);
+}
+
+void add_object(struct ObjectTable *table, struct Object *object)
+{
+    if (2 * (table->count + 1) > table->size)
+    {
+        rehash_objects(table, table->size ? 2 * table->size : INITIAL_OBJECT_TABLE_SIZE);
+    }
+    insert_object(table, object);
+}
+
+/*
+ * The lock is not held while the string is allocated, because allocating may
+ * stop the world. Another thread may have interned the same characters in the
+ * meantime, so we look again before inserting.
+ */
+struct Object *intern_string_of_length(struct VM *vm, char *characters, int length)
+{
+    struct Heap *heap = vm->heap;
+    uint64_t hash = hash_characters(characters, length);
+    struct Object *string;
+    struct Object *existing;
+    pthread_mutex_lock(&heap->lock);
+    string = find_string(&heap->interned_strings, characters, length, hash);
+    pthread_mutex_unlock(&heap->lock);
+    if (string)
+    {
+        return string;
+    }
+    string = new_string_of_length(vm, characters, length);
+    pthread_mutex_lock(&heap->lock);
+    existing = find_string(&heap->interned_strings, characters, length, hash);
+    if (existing)
+    {
+        string = existing;
+    }
+    else
+    {
+        string->interned = 1;
+        add_object(&heap->interned_strings, string);
+    }
+    pthread_mutex_unlock(&heap->lock);
+    return string;
+}
+
+struct Object *intern_string(struct VM *vm, char *string)
+{
+    return intern_string_of_length(vm, string, strlen(string));
+}
+
+/*
+ * Hash-consing does for pairs what interning does for strings: there is at
+ * most one hash-consed pair of any head and tail, so lists and trees built
+ * from them share every common tail and subtree, and two of them are
+ * structurally equal exactly if they are the same object. Heads and tails are
+ * compared like map keys, numbers and strings by value and everything else,
+ * hash-consed pairs included, by identity; only 0 and -0 are told apart.
+ * Hash-consed pairs are flagged as "interned" as well, must not be changed,
+ * and are kept in a table of the heap just as weakly.
+ *
+ * With hash-consing turned on for a heap, the language builds all its pairs
+ * this way.
+ */
+struct Object *hash_cons_pair(struct VM *vm, struct Object *head, struct Object *tail)
+{
+    struct Heap *heap = vm->heap;
+    struct Object *pair;
+    struct Object *existing;
+    pthread_mutex_lock(&heap->lock);
+    pair = find_pair(&heap->hash_consed_pairs, head, tail);
+    pthread_mutex_unlock(&heap->lock);
+    if (pair)
+    {
+        return pair;
+    }
+    pair = new_pair(vm, head, tail);
+    pthread_mutex_lock(&heap->lock);
+    existing = find_pair(&heap->hash_consed_pairs, head, tail);
+    if (existing)
+    {
+        pair = existing;
+    }
+    else
+    {
+        pair->interned = 1;
+        add_object(&heap->hash_consed_pairs, pair);
+    }
+    pthread_mutex_unlock(&heap->lock);
+    return pair;
+}
+
+void set_hash_consing(struct Heap *heap, int enabled)
+{
+    heap->hash_cons_pairs = enabled;
+}
+
+struct Object *cons_pair(struct VM *vm, struct Object *head, struct Object *tail)
+{
+    return vm->heap->hash_cons_pairs ? hash_cons_pair(vm, head, tail) : new_pair(vm, head, tail);
+}
+
+/*
+ * Functions for float array operations. Where the CPU supports it we use AVX2
+ * to process four doubles per instruction, finishing the last few elements
+ * with plain C. "operation" is one of '+', '-', '*' and '/'.
+ */
+void combine_floats_scalar(char operation, double *result, double *operand1, double *operand2, int length)
+{
+    int i;
+    switch (operation)
+    {
+        case '+':
+            for (i = 0; i < length; i++)
+            {
+                result[i] = operand1[i] + operand2[i];
+            }
+            break;
+        case '-':
+            for (i = 0; i < length; i++)
+            {
+                result[i] = operand1[i] - operand2[i];
+            }
+            break;
+        case '*':
+            for (i = 0; i < length; i++)
+            {
+                result[i] = operand1[i] * operand2[i];
+            }
+            break;
+        case '/':
+            for (i = 0; i < length; i++)
+            {
+                result[i] = operand1[i] / operand2[i];
+            }
+            break;
+    }
+}
+
+double sum_floats_scalar(double *floats, int length)
+{
+    int i;
+    double sum = 0;
+    for (i = 0; i < length; i++)
+    {
+        sum += floats[i];
+    }
+    return sum;
+}
+
+double dot_floats_scalar(double *operand1, double *operand2, int length)
+{
+    int i;
+    double sum = 0;
+    for (i = 0; i < length; i++)
+    {
+        sum += operand1[i] * operand2[i];
+    }
+    return sum;
+}
+
+#ifdef SIMD
+__attribute__((target("avx2")))
+void combine_floats_avx2(char operation, double *result, double *operand1, double *operand2, int length)
+{
+    int i = 0;
+    __m256d vector1;
+    __m256d vector2;
+    for (i = 0; i + 4 <= length; i += 4)
+    {
+        vector1 = _mm256_load_pd(operand1 + i);
+        vector2 = _mm256_load_pd(operand2 + i);
+        switch (operation)
+        {
+            case '+':
+                vector1 = _mm256_add_pd(vector1, vector2);
+                break;
+            case '-':
+                vector1 = _mm256_sub_pd(vector1, vector2);
+                break;
+            case '*':
+                vector1 = _mm256_mul_pd(vector1, vector2);
+                break;
+            case '/':
+                vector1 = _mm256_div_pd(vector1, vector2);
+                break;
+        }
+        _mm256_store_pd(result + i, vector1);
+    }
+    combine_floats_scalar(operation, result + i, operand1 + i, operand2 + i, length - i);
+}
+
+/*
+ * The sums use two independent accumulators so that consecutive additions
+ * don't have to wait for each other.
+ */
+__attribute__((target("avx2")))
+double sum_floats_avx2(double *floats, int length)
+{
+    int i;
+    double lanes[4];
+    __m256d sum1 = _mm256_setzero_pd();
+    __m256d sum2 = _mm256_setzero_pd();
+    for (i = 0; i + 8 <= length; i += 8)
+    {
+        sum1 = _mm256_add_pd(sum1, _mm256_load_pd(floats + i));
+        sum2 = _mm256_add_pd(sum2, _mm256_load_pd(floats + i + 4));
+    }
+    _mm256_storeu_pd(lanes, _mm256_add_pd(sum1, sum2));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sum_floats_scalar(floats + i, length - i);
+}
+
+__attribute__((target("avx2,fma")))
+double dot_floats_avx2(double *operand1, double *operand2, int length)
+{
+    int i;
+    double lanes[4];
+    __m256d sum1 = _mm256_setzero_pd();
+    __m256d sum2 = _mm256_setzero_pd();
+    for (i = 0; i + 8 <= length; i += 8)
+    {
+        sum1 = _mm256_fmadd_pd(_mm256_load_pd(operand1 + i), _mm256_load_pd(operand2 + i), sum1);
+        sum2 = _mm256_fmadd_pd(_mm256_load_pd(operand1 + i + 4), _mm256_load_pd(operand2 + i + 4), sum2);
+    }
+    _mm256_storeu_pd(lanes, _mm256_add_pd(sum1, sum2));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + dot_floats_scalar(operand1 + i, operand2 + i, length - i);
+}
+#endif
+
+/*
+ * Combines two float arrays element by element. If their lengths differ, the
+ * result is as long as the shorter one.
+ */
+struct Object *combine_floats(struct VM *vm, char operation, struct Object *operand1, struct Object *operand2)
+{
+    int length = operand1->length < operand2->length ? operand1->length : operand2->length;
+    struct Object *result = new_float_array(vm, length);
+#ifdef SIMD
+    if (__builtin_cpu_supports("avx2"))
+    {
+        combine_floats_avx2(operation, result->floats, operand1->floats, operand2->floats, length);
+        return result;
+    }
+#endif
+    combine_floats_scalar(operation, result->floats, operand1->floats, operand2->floats, length);
+    return result;
+}
+
+double sum_floats(struct Object *array)
+{
+#ifdef SIMD
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return sum_floats_avx2(array->floats, array->length);
+    }
+#endif
+    return sum_floats_scalar(array->floats, array->length);
+}
+
+double dot_floats(struct Object *operand1, struct Object *operand2)
+{
+    int length = operand1->length < operand2->length ? operand1->length : operand2->length;
+#ifdef SIMD
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    {
+        return dot_floats_avx2(operand1->floats, operand2->floats, length);
+    }
+#endif
+    return dot_floats_scalar(operand1->floats, operand2->floats, length);
+}
+
+/*
+ * Calling stdio for every character and number we print takes a lock each
+ * time, so instead we collect output in a large buffer of our own and hand it
+ * to stdio only when it is full or when we are done.
+ */
+void flush_output(struct VM *vm)
+{
+    fwrite(vm->output_buffer, sizeof(char), vm->output_length, stdout);
+    vm->output_length = 0;
+}
+
+void output_bytes(struct VM *vm, char *bytes, int length)
+{
+    if (vm->output_length + length > OUTPUT_BUFFER_SIZE)
+    {
+        flush_output(vm);
+        if (length > OUTPUT_BUFFER_SIZE)
+        {
+            fwrite(bytes, sizeof(char), length, stdout);
+            return;
+        }
+    }
+    memcpy(vm->output_buffer + vm->output_length, bytes, length);
+    vm->output_length += length;
+}
+
+void output_char(struct VM *vm, char character)
+{
+    if (vm->output_length == OUTPUT_BUFFER_SIZE)
+    {
+        flush_output(vm);
+    }
+    vm->output_buffer[vm->output_length] = character;
+    vm->output_length++;
+}
+
+void output_string(struct VM *vm, char *string)
+{
+    output_bytes(vm, string, strlen(string));
+}
+
+/*
+ * Formats a number with as few digits as possible such that reading it back
+ * gives exactly the same double. Integers, by far the most common numbers in
+ * our scripts, are converted digit by digit. Everything else goes through
+ * Grisu2, Florian Loitsch's algorithm from "Printing Floating-Point Numbers
+ * Quickly and Accurately with Integers", in the form popularized by Milo Yip.
+ *
+ * A double is a 64 bit "do-it-yourself floating point" number f * 2^e. We
+ * compute the numbers halfway to its neighbours, the boundaries of all decimals
+ * that read back as the double, and scale all three by a cached power of ten
+ * that brings them into a range where their digits can be produced with 64 bit
+ * integer arithmetic. Digits are generated until the result lies between the
+ * boundaries, and the last digit is nudged towards the exact value. The digits
+ * always read back correctly and are the shortest possible for all but a tiny
+ * fraction of doubles, where one digit more is printed.
+ *
+ * The cached powers are 10^-348, 10^-340, ..., 10^340, each rounded to a 64 bit
+ * significand with its binary exponent.
+ */
+struct DiyFp
+{
+    uint64_t f;
+    int e;
+};
+
+const uint64_t cached_powers_f[] =
+{
+    0xfa8fd5a0081c0288, 0xbaaee17fa23ebf76, 0x8b16fb203055ac76, 0xcf42894a5dce35ea,
+    0x9a6bb0aa55653b2d, 0xe61acf033d1a45df, 0xab70fe17c79ac6ca, 0xff77b1fcbebcdc4f,
+    0xbe5691ef416bd60c, 0x8dd01fad907ffc3c, 0xd3515c2831559a83, 0x9d71ac8fada6c9b5,
+    0xea9c227723ee8bcb, 0xaecc49914078536d, 0x823c12795db6ce57, 0xc21094364dfb5637,
+    0x9096ea6f3848984f, 0xd77485cb25823ac7, 0xa086cfcd97bf97f4, 0xef340a98172aace5,
+    0xb23867fb2a35b28e, 0x84c8d4dfd2c63f3b, 0xc5dd44271ad3cdba, 0x936b9fcebb25c996,
+    0xdbac6c247d62a584, 0xa3ab66580d5fdaf6, 0xf3e2f893dec3f126, 0xb5b5ada8aaff80b8,
+    0x87625f056c7c4a8b, 0xc9bcff6034c13053, 0x964e858c91ba2655, 0xdff9772470297ebd,
+    0xa6dfbd9fb8e5b88f, 0xf8a95fcf88747d94, 0xb94470938fa89bcf, 0x8a08f0f8bf0f156b,
+    0xcdb02555653131b6, 0x993fe2c6d07b7fac, 0xe45c10c42a2b3b06, 0xaa242499697392d3,
+    0xfd87b5f28300ca0e, 0xbce5086492111aeb, 0x8cbccc096f5088cc, 0xd1b71758e219652c,
+    0x9c40000000000000, 0xe8d4a51000000000, 0xad78ebc5ac620000, 0x813f3978f8940984,
+    0xc097ce7bc90715b3, 0x8f7e32ce7bea5c70, 0xd5d238a4abe98068, 0x9f4f2726179a2245,
+    0xed63a231d4c4fb27, 0xb0de65388cc8ada8, 0x83c7088e1aab65db, 0xc45d1df942711d9a,
+    0x924d692ca61be758, 0xda01ee641a708dea, 0xa26da3999aef774a, 0xf209787bb47d6b85,
+    0xb454e4a179dd1877, 0x865b86925b9bc5c2, 0xc83553c5c8965d3d, 0x952ab45cfa97a0b3,
+    0xde469fbd99a05fe3, 0xa59bc234db398c25, 0xf6c69a72a3989f5c, 0xb7dcbf5354e9bece,
+    0x88fcf317f22241e2, 0xcc20ce9bd35c78a5, 0x98165af37b2153df, 0xe2a0b5dc971f303a,
+    0xa8d9d1535ce3b396, 0xfb9b7cd9a4a7443c, 0xbb764c4ca7a44410, 0x8bab8eefb6409c1a,
+    0xd01fef10a657842c, 0x9b10a4e5e9913129, 0xe7109bfba19c0c9d, 0xac2820d9623bf429,
+    0x80444b5e7aa7cf85, 0xbf21e44003acdd2d, 0x8e679c2f5e44ff8f, 0xd433179d9c8cb841,
+    0x9e19db92b4e31ba9, 0xeb96bf6ebadf77d9, 0xaf87023b9bf0ee6b
+};
+
+const short cached_powers_e[] =
+{
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927,
+    -901, -874, -847, -821, -794, -768, -741, -715, -688, -661, -635, -608,
+    -582, -555, -529, -502, -475, -449, -422, -396, -369, -343, -316, -289,
+    -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30,
+    56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614, 641, 667,
+    694, 720, 747, 774, 800, 827, 853, 880, 907, 933, 960, 986,
+    1013, 1039, 1066
+};
+
+const uint64_t powers_of_ten[] =
+{
+    1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull,
+    100000000ull, 1000000000ull, 10000000000ull, 100000000000ull,
+    1000000000000ull, 10000000000000ull, 100000000000000ull,
+    1000000000000000ull, 10000000000000000ull, 100000000000000000ull,
+    1000000000000000000ull, 10000000000000000000ull
+};
+
+struct DiyFp multiply_diy_fp(struct DiyFp a, struct DiyFp b)
+{
+    unsigned __int128 product = (unsigned __int128)a.f * b.f;
+    struct DiyFp result;
+    result.f = (uint64_t)(product >> 64) + ((uint64_t)product >> 63);
+    result.e = a.e + b.e + 64;
+    return result;
+}
+
+struct DiyFp normalize_diy_fp(struct DiyFp x)
+{
+    int shift = __builtin_clzll(x.f);
+    x.f <<= shift;
+    x.e -= shift;
+    return x;
+}
+
+/*
+ * Splits a positive finite double into a DiyFp and computes the boundaries,
+ * both normalized to the exponent of the upper one.
+ */
+struct DiyFp split_double(double number, struct DiyFp *minus, struct DiyFp *plus)
+{
+    uint64_t bits;
+    struct DiyFp v;
+    memcpy(&bits, &number, sizeof(bits));
+    v.f = bits & ((1ull << 52) - 1);
+    v.e = (int)(bits >> 52 & 0x7ff);
+    if (v.e)
+    {
+        v.f += 1ull << 52;
+        v.e -= 1075;
+    }
+    else
+    {
+        v.e = -1074;
+    }
+    plus->f = (v.f << 1) + 1;
+    plus->e = v.e - 1;
+    *plus = normalize_diy_fp(*plus);
+    if (v.f == 1ull << 52)
+    {
+        minus->f = (v.f << 2) - 1;
+        minus->e = v.e - 2;
+    }
+    else
+    {
+        minus->f = (v.f << 1) - 1;
+        minus->e = v.e - 1;
+    }
+    minus->f <<= minus->e - plus->e;
+    minus->e = plus->e;
+    return normalize_diy_fp(v);
+}
+
+/*
+ * Returns the cached power c = 10^-k such that the exponent of a number with
+ * binary exponent "e", multiplied by c, lies between -60 and -32.
+ */
+struct DiyFp cached_power(int e, int *k)
+{
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int i = (int)dk;
+    struct DiyFp power;
+    if (dk - i > 0.0)
+    {
+        i++;
+    }
+    i = (i >> 3) + 1;
+    *k = -(-348 + i * 8);
+    power.f = cached_powers_f[i];
+    power.e = cached_powers_e[i];
+    return power;
+}
+
+void round_last_digit(char *digits, int length, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t distance)
+{
+    while (rest < distance && delta - rest >= ten_kappa && (rest + ten_kappa < distance || distance - rest > rest + ten_kappa - distance))
+    {
+        digits[length - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+/*
+ * Generates the digits of "high" until they are within "delta" of it, i.e.
+ * above the lower boundary, and returns how many there are. The decimal
+ * exponent of the last digit is added to "k".
+ */
+int generate_digits(struct DiyFp w, struct DiyFp high, uint64_t delta, char *digits, int *k)
+{
+    struct DiyFp one;
+    uint64_t distance = high.f - w.f;
+    uint32_t integral;
+    uint64_t fraction;
+    uint64_t rest;
+    int kappa = 10;
+    int length = 0;
+    int digit;
+    one.f = 1ull << -high.e;
+    one.e = high.e;
+    integral = (uint32_t)(high.f >> -one.e);
+    fraction = high.f & (one.f - 1);
+    while (kappa > 1 && integral < powers_of_ten[kappa - 1])
+    {
+        kappa--;
+    }
+    while (kappa > 0)
+    {
+        digit = integral / powers_of_ten[kappa - 1];
+        integral %= powers_of_ten[kappa - 1];
+        if (digit || length)
+        {
+            digits[length] = '0' + digit;
+            length++;
+        }
+        kappa--;
+        rest = ((uint64_t)integral << -one.e) + fraction;
+        if (rest <= delta)
+        {
+            *k += kappa;
+            round_last_digit(digits, length, delta, rest, powers_of_ten[kappa] << -one.e, distance);
+            return length;
+        }
+    }
+    while (1)
+    {
+        fraction *= 10;
+        delta *= 10;
+        digit = (int)(fraction >> -one.e);
+        if (digit || length)
+        {
+            digits[length] = '0' + digit;
+            length++;
+        }
+        fraction &= one.f - 1;
+        kappa--;
+        if (fraction < delta)
+        {
+            *k += kappa;
+            round_last_digit(digits, length, delta, fraction, one.f, -kappa < 20 ? distance * powers_of_ten[-kappa] : 0);
+            return length;
+        }
+    }
+}
+
+/*
+ * Writes the shortest digits of a positive finite double and returns their
+ * number; the number is the digits times 10^k.
+ */
+int shortest_digits(double number, char *digits, int *k)
+{
+    struct DiyFp minus;
+    struct DiyFp plus;
+    struct DiyFp v = split_double(number, &minus, &plus);
+    struct DiyFp power = cached_power(plus.e, k);
+    struct DiyFp w = multiply_diy_fp(v, power);
+    struct DiyFp high = multiply_diy_fp(plus, power);
+    struct DiyFp low = multiply_diy_fp(minus, power);
+    low.f++;
+    high.f--;
+    return generate_digits(w, high, high.f - low.f, digits, k);
+}
+
+/*
+ * Numbers that aren't integers are laid out the way printf's "%.15g" does,
+ * with more precision where 15 digits are not enough: in scientific notation
+ * if the exponent is below -4 or not below the precision, otherwise in plain
+ * decimal notation.
+ */
+int format_number(double number, char *buffer)
+{
+    char digits[NUMBER_SIZE];
+    int length = 0;
+    int count;
+    int exponent;
+    int precision;
+    int k;
+    int i;
+    long long integer;
+    if (number == floor(number) && fabs(number) < 1e15)
+    {
+        integer = number < 0 ? -number : number;
+        if (signbit(number))
+        {
+            buffer[length] = '-';
+            length++;
+        }
+        precision = 0;
+        do
+        {
+            digits[precision] = '0' + integer % 10;
+            precision++;
+            integer /= 10;
+        }
+        while (integer > 0);
+        while (precision > 0)
+        {
+            precision--;
+            buffer[length] = digits[precision];
+            length++;
+        }
+        buffer[length] = '\0';
+        return length;
+    }
+    if (!isfinite(number))
+    {
+        return snprintf(buffer, NUMBER_SIZE, "%g", number);
+    }
+    if (number < 0)
+    {
+        buffer[length] = '-';
+        length++;
+        number = -number;
+    }
+    count = shortest_digits(number, digits, &k);
+    exponent = count + k - 1;
+    precision = count > 15 ? count : 15;
+    if (exponent < -4 || exponent >= precision)
+    {
+        buffer[length] = digits[0];
+        length++;
+        if (count > 1)
+        {
+            buffer[length] = '.';
+            length++;
+            memcpy(buffer + length, digits + 1, count - 1);
+            length += count - 1;
+        }
+        length += sprintf(buffer + length, "e%c%02d", exponent < 0 ? '-' : '+', abs(exponent));
+    }
+    else if (exponent < 0)
+    {
+        buffer[length] = '0';
+        buffer[length + 1] = '.';
+        length += 2;
+        for (i = exponent + 1; i < 0; i++)
+        {
+            buffer[length] = '0';
+            length++;
+        }
+        memcpy(buffer + length, digits, count);
+        length += count;
+    }
+    else
+    {
+        for (i = 0; i <= exponent || i < count; i++)
+        {
+            if (i == exponent + 1)
+            {
+                buffer[length] = '.';
+                length++;
+            }
+            buffer[length] = i < count ? digits[i] : '0';
+            length++;
+        }
+    }
+    buffer[length] = '\0';
+    return length;
+}
+
+void output_number(struct VM *vm, double number)
+{
+    char buffer[NUMBER_SIZE];
+    output_bytes(vm, buffer, format_number(number, buffer));
+}
+
+/*
+ * Functions that print objects in a human readable form. Pairs are printed in a
+ * lisp-like fashion.
+ *
+ * Printing a data structure recursively would use one C stack frame per level
+ * of nesting, so a deep structure could crash the program, and a cyclic one
+ * would never stop printing. Instead we print in two iterative passes:
+ *
+ * 1. Walk the structure with an explicit stack and remember every array, pair,
+ *    list and map we find in a hash table. Those we find a second time are
+ *    shared.
+ * 2. Print the structure, again with an explicit stack of work items. The first
+ *    time a shared object is printed it gets a label, e.g. "#1=(1 2)", and
+ *    every later occurrence is printed as a reference to that label, "#1#",
+ *    instead of being printed again. This is how Common Lisp prints circular
+ *    structures.
+ *
+ * Numbers, strings and float arrays cannot contain other objects, so they are
+ * simply printed every time.
+ *
+ * The labels of the table are 0 for objects found only once, -1 for shared
+ * objects that haven't been printed yet and the label of shared objects that
+ * have.
+ */
+struct PrintTable
+{
+    int count;
+    int size;
+    struct Object **objects;
+    int *labels;
+};
+
+int is_container(struct Object *object)
+{
+    return object && (object->type == ARRAY || object->type == LIST || object->type == MAP || object->type == PAIR);
+}
+
+/*
+ * Returns the slot of an object in the table, which is either the slot holding
+ * the object or the empty slot where it would go.
+ */
+int find_in_print_table(struct PrintTable *table, struct Object *object)
+{
+    int i = ((uintptr_t)object >> 4) * 2654435761u & (table->size - 1);
+    while (table->objects[i] && table->objects[i] != object)
+    {
+        i = (i + 1) & (table->size - 1);
+    }
+    return i;
+}
+
+void add_to_print_table(struct PrintTable *table, struct Object *object)
+{
+    int i;
+    int j;
+    struct PrintTable old = *table;
+    if (2 * (table->count + 1) > table->size)
+    {
+        table->size = table->size ? table->size * 2 : INITIAL_PRINT_TABLE_SIZE;
+        table->objects = calloc(table->size, sizeof(struct Object *));
+        table->labels = calloc(table->size, sizeof(int));
+        for (i = 0; i < old.size; i++)
+        {
+            if (old.objects[i])
+            {
+                j = find_in_print_table(table, old.objects[i]);
+                table->objects[j] = old.objects[i];
+                table->labels[j] = old.labels[i];
+            }
+        }
+        free(old.objects);
+        free(old.labels);
+    }
+    table->objects[find_in_print_table(table, object)] = object;
+    table->count++;
+}
+
+void find_shared_objects(struct PrintTable *table, struct Object *object)
+{
+    int i;
+    struct ObjectStack stack = {0, 0, NULL};
+    push_object(&stack, object);
+    while (stack.length > 0)
+    {
+        stack.length--;
+        object = stack.objects[stack.length];
+        if (!is_container(object))
+        {
+            continue;
+        }
+        if (table->size)
+        {
+            i = find_in_print_table(table, object);
+            if (table->objects[i])
+            {
+                table->labels[i] = -1;
+                continue;
+            }
+        }
+        add_to_print_table(table, object);
+        if (object->type == ARRAY)
+        {
+            for (i = object->length - 1; i >= 0; i--)
+            {
+                push_object(&stack, object->array[i]);
+            }
+        }
+        else if (object->type == LIST)
+        {
+            push_object(&stack, object->list_tail);
+            for (i = object->list_length - 1; i >= 0; i--)
+            {
+                push_object(&stack, object->heads[i]);
+            }
+        }
+        else if (object->type == MAP)
+        {
+            for (i = object->size - 1; i >= 0; i--)
+            {
+                if (object->table->control[i] < MAP_EMPTY)
+                {
+                    push_object(&stack, object->table->slots[2 * i + 1]);
+                    push_object(&stack, object->table->slots[2 * i]);
+                }
+            }
+        }
+        else
+        {
+            push_object(&stack, object->tail);
+            push_object(&stack, object->head);
+        }
+    }
+    free(stack.objects);
+}
+
+/*
+ * The work items of the second pass:
+ * - PRINT_VALUE prints an object.
+ * - PRINT_ELEMENT prints the element at "index" of an array and everything
+ *   after it.
+ * - PRINT_ENTRY prints the first entry of a map from slot "index" on and
+ *   everything after it, preceded by "text".
+ * - PRINT_HEAD prints the head at "index" of a list and everything after it.
+ * - PRINT_REST prints what follows the head of a list, where "object" is the
+ *   tail.
+ * - PRINT_TEXT prints "text".
+ */
+enum PrintKind
+{
+    PRINT_ELEMENT,
+    PRINT_ENTRY,
+    PRINT_HEAD,
+    PRINT_REST,
+    PRINT_TEXT,
+    PRINT_VALUE
+};
+
+struct PrintItem
+{
+    enum PrintKind kind;
+    int index;
+    struct Object *object;
+    char *text;
+};
+
+struct PrintStack
+{
+    int length;
+    int size;
+    struct PrintItem *items;
+};
+
+void push_print_item(struct PrintStack *stack, enum PrintKind kind, int index, struct Object *object, char *text)
+{
+    if (stack->length == stack->size)
+    {
+        stack->size = stack->size ? stack->size * 2 : INITIAL_ARRAY_SIZE;
+        stack->items = realloc(stack->items, stack->size * sizeof(struct PrintItem));
+    }
+    stack->items[stack->length].kind = kind;
+    stack->items[stack->length].index = index;
+    stack->items[stack->length].object = object;
+    stack->items[stack->length].text = text;
+    stack->length++;
+}
+
+int is_shared(struct PrintTable *table, struct Object *object)
+{
+    return is_container(object) && table->labels[find_in_print_table(table, object)];
+}
+
+void print_float_array(struct VM *vm, struct Object *array)
+{
+    int i;
+    output_string(vm, "#[");
+    for (i = 0; i < array->length; i++)
+    {
+        if (i > 0)
+        {
+            output_string(vm, ", ");
+        }
+        output_number(vm, array->floats[i]);
+    }
+    output_char(vm, ']');
+}
+
+/*
+ * Prints the label of a shared object. Returns 1 if the object has been
+ * printed before, so that only a reference to the label was printed.
+ */
+int print_label(struct VM *vm, struct PrintTable *table, struct Object *object, int *next_label)
+{
+    char buffer[NUMBER_SIZE];
+    int i = find_in_print_table(table, object);
+    output_char(vm, '#');
+    if (table->labels[i] > 0)
+    {
+        output_bytes(vm, buffer, format_number(table->labels[i], buffer));
+        output_char(vm, '#');
+        return 1;
+    }
+    table->labels[i] = *next_label;
+    (*next_label)++;
+    output_bytes(vm, buffer, format_number(table->labels[i], buffer));
+    output_char(vm, '=');
+    return 0;
+}
+
+void print_value(struct VM *vm, struct PrintStack *stack, struct PrintTable *table, struct Object *object, int *next_label)
+{
+    if (!object)
+    {
+        output_string(vm, "null");
+        return;
+    }
+    if (is_shared(table, object) && print_label(vm, table, object, next_label))
+    {
+        return;
+    }
+    switch (object->type)
+    {
+        case ARRAY:
+            output_char(vm, '[');
+            push_print_item(stack, PRINT_ELEMENT, 0, object, NULL);
+            break;
+        case FLOAT_ARRAY:
+            print_float_array(vm, object);
+            break;
+        case LIST:
+            output_char(vm, '(');
+            push_print_item(stack, PRINT_HEAD, 0, object, NULL);
+            break;
+        case MAP:
+            output_char(vm, '{');
+            push_print_item(stack, PRINT_ENTRY, 0, object, "");
+            break;
+        case NUMBER:
+            output_number(vm, object->number);
+            break;
+        case PAIR:
+            output_char(vm, '(');
+            push_print_item(stack, PRINT_REST, 0, object->tail, NULL);
+            push_print_item(stack, PRINT_VALUE, 0, object->head, NULL);
+            break;
+        case STRING:
+            output_char(vm, '"');
+            output_bytes(vm, object->characters, object->string_length);
+            output_char(vm, '"');
+            break;
+        case ELEMENTS:
+            output_string(vm, "#<elements>");
+            break;
+        case EPHEMERON_TABLE:
+            output_string(vm, "#<ephemeron table>");
+            break;
+        case WEAK_REF:
+            output_string(vm, "#<weak ref>");
+            break;
+    }
+}
+
+void print_object(struct VM *vm, struct Object *object)
+{
+    struct PrintTable table = {0, 0, NULL, NULL};
+    struct PrintStack stack = {0, 0, NULL};
+    struct PrintItem item;
+    int next_label = 1;
+    find_shared_objects(&table, object);
+    push_print_item(&stack, PRINT_VALUE, 0, object, NULL);
+    while (stack.length > 0)
+    {
+        stack.length--;
+        item = stack.items[stack.length];
+        switch (item.kind)
+        {
+            case PRINT_ELEMENT:
+                if (item.index == item.object->length)
+                {
+                    output_char(vm, ']');
+                    break;
+                }
+                if (item.index > 0)
+                {
+                    output_string(vm, ", ");
+                }
+                push_print_item(&stack, PRINT_ELEMENT, item.index + 1, item.object, NULL);
+                push_print_item(&stack, PRINT_VALUE, 0, item.object->array[item.index], NULL);
+                break;
+            case PRINT_ENTRY:
+                while (item.index < item.object->size && item.object->table->control[item.index] >= MAP_EMPTY)
+                {
+                    item.index++;
+                }
+                if (item.index == item.object->size)
+                {
+                    output_char(vm, '}');
+                    break;
+                }
+                output_string(vm, item.text);
+                push_print_item(&stack, PRINT_ENTRY, item.index + 1, item.object, ", ");
+                push_print_item(&stack, PRINT_VALUE, 0, item.object->table->slots[2 * item.index + 1], NULL);
+                push_print_item(&stack, PRINT_TEXT, 0, NULL, ": ");
+                push_print_item(&stack, PRINT_VALUE, 0, item.object->table->slots[2 * item.index], NULL);
+                break;
+            case PRINT_HEAD:
+                if (item.index == item.object->list_length)
+                {
+                    push_print_item(&stack, PRINT_REST, 0, item.object->list_tail, NULL);
+                    break;
+                }
+                if (item.index > 0)
+                {
+                    output_char(vm, ' ');
+                }
+                push_print_item(&stack, PRINT_HEAD, item.index + 1, item.object, NULL);
+                push_print_item(&stack, PRINT_VALUE, 0, item.object->heads[item.index], NULL);
+                break;
+            case PRINT_REST:
+                if (!item.object)
+                {
+                    output_char(vm, ')');
+                }
+                else if (item.object->type == LIST && !is_shared(&table, item.object))
+                {
+                    output_char(vm, ' ');
+                    push_print_item(&stack, PRINT_HEAD, 0, item.object, NULL);
+                }
+                else if (item.object->type == PAIR && !is_shared(&table, item.object))
+                {
+                    output_char(vm, ' ');
+                    push_print_item(&stack, PRINT_REST, 0, item.object->tail, NULL);
+                    push_print_item(&stack, PRINT_VALUE, 0, item.object->head, NULL);
+                }
+                else
+                {
+                    output_string(vm, " . ");
+                    push_print_item(&stack, PRINT_TEXT, 0, NULL, ")");
+                    push_print_item(&stack, PRINT_VALUE, 0, item.object, NULL);
+                }
+                break;
+            case PRINT_TEXT:
+                output_string(vm, item.text);
+                break;
+            case PRINT_VALUE:
+                print_value(vm, &stack, &table, item.object, &next_label);
+                break;
+        }
+    }
+    free(table.objects);
+    free(table.labels);
+    free(stack.items);
+}
+
+/*
+ * We implement a little stack that could be part of a virtual machine.
+ *
+ * The stack grows when it is full. Checking for that costs push() a single
+ * branch that is almost never taken; growing is kept out of line. If the stack
+ * would grow beyond MAXIMUM_STACK_SIZE, we report a stack overflow instead.
+ */
+__attribute__((cold, noinline))
+void grow_stack(struct VM *vm)
+{
+    if (vm->stack_size >= MAXIMUM_STACK_SIZE)
+    {
+        flush_output(vm);
+        fputs("Stack overflow\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+    vm->stack_size = vm->stack_size ? vm->stack_size * 2 : INITIAL_STACK_SIZE;
+    vm->stack = realloc(vm->stack, vm->stack_size * sizeof(struct Object *));
+}
+
+void push(struct VM *vm, struct Object *object)
+{
+    if (__builtin_expect(vm->stack_length == vm->stack_size, 0))
+    {
+        grow_stack(vm);
+    }
+    vm->stack[vm->stack_length] = object;
+    vm->stack_length++;
+}
+
+struct Object *pop(struct VM *vm)
+{
+    vm->stack_length--;
+    return vm->stack[vm->stack_length];
+}
+
+struct Object *peek(struct VM *vm)
+{
+    return vm->stack[vm->stack_length - 1];
+}
+
+/*
+ * A program embedding our virtual machine keeps objects in its own variables,
+ * where the garbage collector cannot see them. It roots them with handles (see
+ * gc.h), slots in a handle area that is scanned like the stack.
+ *
+ * The handle area is a chain of fixed-size blocks, so that handles never move
+ * and creating one is just a pointer bump. A handle scope remembers the top of
+ * the area when it was opened; closing it resets the top, releasing all the
+ * handles created since, and frees the blocks they filled.
+ */
+struct HandleBlock
+{
+    struct HandleBlock *previous;
+    struct Object *handles[HANDLE_BLOCK_SIZE];
+};
+
+void open_handle_scope(struct VM *vm, struct HandleScope *scope)
+{
+    scope->vm = vm;
+    scope->block = vm->handle_block;
+    scope->top = vm->handle_top;
+}
+
+void close_handle_scope(struct HandleScope *scope)
+{
+    struct VM *vm = scope->vm;
+    struct HandleBlock *block;
+    while (vm->handle_block != scope->block)
+    {
+        block = vm->handle_block;
+        vm->handle_block = block->previous;
+        free(block);
+    }
+    vm->handle_top = scope->top;
+    vm->handle_end = scope->block ? scope->block->handles + HANDLE_BLOCK_SIZE : NULL;
+}
+
+__attribute__((cold, noinline))
+void add_handle_block(struct VM *vm)
+{
+    struct HandleBlock *block = malloc(sizeof(struct HandleBlock));
+    block->previous = vm->handle_block;
+    vm->handle_block = block;
+    vm->handle_top = block->handles;
+    vm->handle_end = block->handles + HANDLE_BLOCK_SIZE;
+}
+
+struct Object **new_handle(struct VM *vm, struct Object *object)
+{
+    if (__builtin_expect(vm->handle_top == vm->handle_end, 0))
+    {
+        add_handle_block(vm);
+    }
+    *vm->handle_top = object;
+    return vm->handle_top++;
+}
+
+/*
+ * Our garbage collector will have to mark reachable objects. However if a
+ * reachable object is a data structure, then its elements must also be marked.
+ * If they are also data structures, then their elements must also be marked and
+ * so on. Thus we need a recursive function.
+ *
+ * Cyclical references could lead to an infinite recursion. To avoid this, we
+ * won't mark objects already marked.
+ *
+ * The targets of weak references are not marked. Instead the references are
+ * remembered in the heap, to be cleared later if their targets turn out to be
+ * unreachable. The same goes for ephemeron tables. The value of an entry is
+ * marked right away if its key is already marked; otherwise key and value are
+ * remembered as a pending ephemeron, since the key might still be marked later.
+ *
+ * Pending ephemerons are kept in a hash table by the address of their keys,
+ * probed linearly and at most half full. Whenever an object is marked while
+ * there are pending ephemerons, we look it up there and mark the values of the
+ * ephemerons it is the key of. Each ephemeron is thus looked at once when it
+ * is remembered and once when its key is marked, however the keys and values
+ * of ephemerons reference each other. The values are marked one after the
+ * other from a stack rather than from within each other, so that a long chain
+ * of ephemerons doesn't recurse as deep as it is long.
+ *
+ * Ephemerons whose keys are never marked stay pending until the weak
+ * references are cleared, since finalization may still mark their keys.
+ */
+void mark_elements(struct Heap *, struct Object *);
+void mark_ephemeron_table(struct Heap *, struct Object *);
+void mark_map(struct Heap *, struct Object *);
+void mark_object(struct Heap *, struct Object *);
+
+void mark_elements(struct Heap *heap, struct Object *array)
+{
+    int i;
+    for (i = 0; i < array->length; i++)
+    {
+        mark_object(heap, array->array[i]);
+    }
+}
+
+void mark_map(struct Heap *heap, struct Object *map)
+{
+    int i;
+    for (i = 0; i < map->size; i++)
+    {
+        if (map->table->control[i] < MAP_EMPTY)
+        {
+            mark_object(heap, map->table->slots[2 * i]);
+            mark_object(heap, map->table->slots[2 * i + 1]);
+        }
+    }
+}
+
+void add_pending_ephemeron(struct Heap *heap, struct Object *key, struct Object *value)
+{
+    struct PendingEphemerons *ephemerons = &heap->ephemerons;
+    struct Object **slots = ephemerons->slots;
+    int size = ephemerons->size;
+    int i;
+    int j;
+    if (2 * (ephemerons->used + 1) > ephemerons->size)
+    {
+        ephemerons->size = INITIAL_OBJECT_TABLE_SIZE;
+        while (ephemerons->size < 4 * (ephemerons->pending + 1))
+        {
+            ephemerons->size *= 2;
+        }
+        ephemerons->slots = calloc(2 * ephemerons->size, sizeof(struct Object *));
+        ephemerons->used = 0;
+        ephemerons->pending = 0;
+        for (i = 0; i < size; i++)
+        {
+            if (slots[2 * i] && !slots[2 * i]->mark)
+            {
+                add_pending_ephemeron(heap, slots[2 * i], slots[2 * i + 1]);
+            }
+        }
+        free(slots);
+    }
+    j = mix_hash((uintptr_t)key) & (ephemerons->size - 1);
+    while (ephemerons->slots[2 * j])
+    {
+        j = (j + 1) & (ephemerons->size - 1);
+    }
+    ephemerons->slots[2 * j] = key;
+    ephemerons->slots[2 * j + 1] = value;
+    ephemerons->used++;
+    ephemerons->pending++;
+}
+
+void resolve_ephemerons(struct Heap *heap, struct Object *key)
+{
+    struct PendingEphemerons *ephemerons = &heap->ephemerons;
+    struct ObjectStack *values = &heap->ephemeron_values;
+    int i = mix_hash((uintptr_t)key) & (ephemerons->size - 1);
+    while (ephemerons->slots[2 * i])
+    {
+        if (ephemerons->slots[2 * i] == key)
+        {
+            push_object(values, ephemerons->slots[2 * i + 1]);
+            ephemerons->pending--;
+        }
+        i = (i + 1) & (ephemerons->size - 1);
+    }
+    if (heap->resolving_ephemerons)
+    {
+        return;
+    }
+    heap->resolving_ephemerons = 1;
+    while (values->length > 0)
+    {
+        values->length--;
+        mark_object(heap, values->objects[values->length]);
+    }
+    heap->resolving_ephemerons = 0;
+}
+
+void mark_ephemeron_table(struct Heap *heap, struct Object *table)
+{
+    struct Object *key;
+    int i;
+    push_object(&heap->ephemeron_tables, table);
+    for (i = 0; i < table->size; i++)
+    {
+        if (table->table->control[i] < MAP_EMPTY)
+        {
+            key = table->table->slots[2 * i];
+            if (!key || key->mark)
+            {
+                mark_object(heap, table->table->slots[2 * i + 1]);
+            }
+            else
+            {
+                add_pending_ephemeron(heap, key, table->table->slots[2 * i + 1]);
+            }
+        }
+    }
+}
+
+void mark_list(struct Heap *heap, struct Object *list)
+{
+    int i;
+    for (i = 0; i < list->list_length; i++)
+    {
+        mark_object(heap, list->heads[i]);
+    }
+    mark_object(heap, list->list_tail);
+}
+
+void mark_object(struct Heap *heap, struct Object *object)
+{
+    if (object && !object->mark)
+    {
+        object->mark = 1;
+        if (heap->ephemerons.pending)
+        {
+            resolve_ephemerons(heap, object);
+        }
+        switch (object->type)
+        {
+            case ARRAY:
+                mark_elements(heap, object);
+                mark_object(heap, elements_of(object));
+                break;
+            case ELEMENTS:
+                break;
+            case EPHEMERON_TABLE:
+                mark_ephemeron_table(heap, object);
+                break;
+            case FLOAT_ARRAY:
+                break;
+            case LIST:
+                mark_list(heap, object);
+                break;
+            case MAP:
+                mark_map(heap, object);
+                break;
+            case NUMBER:
+                break;
+            case PAIR:
+                mark_object(heap, object->head);
+                mark_object(heap, object->tail);
+                break;
+            case STRING:
+                break;
+            case WEAK_REF:
+                push_object(&heap->weak_refs, object);
+                break;
+        }
+    }
+}
+
+/*
+ * Unmarked objects with a finalizer are moved to the finalization queue, and
+ * everything in the queue is marked again, so that these objects survive until
+ * their finalizers have run. Once a finalizer has run, its object is deleted
+ * by the next collection that finds it unreachable.
+ */
+void queue_finalizers(struct Heap *heap)
+{
+    struct Finalizer **finalizer = &heap->finalizers;
+    struct Finalizer *unreachable;
+    while (*finalizer)
+    {
+        if ((*finalizer)->object->mark)
+        {
+            finalizer = &(*finalizer)->next;
+        }
+        else
+        {
+            unreachable = *finalizer;
+            *finalizer = unreachable->next;
+            unreachable->next = heap->finalization_queue;
+            heap->finalization_queue = unreachable;
+        }
+    }
+    for (unreachable = heap->finalization_queue; unreachable; unreachable = unreachable->next)
+    {
+        mark_object(heap, unreachable->object);
+    }
+}
+
+/*
+ * Now everything unmarked is garbage. Weak references to garbage are cleared
+ * and entries with garbage keys are removed from their tables, before the
+ * garbage is deleted. So are garbage strings from the table of interned
+ * strings and garbage pairs from that of hash-consed pairs.
+ */
+void clear_weak_references(struct Heap *heap)
+{
+    struct Object *object;
+    int i;
+    int j;
+    for (i = 0; i < heap->weak_refs.length; i++)
+    {
+        object = heap->weak_refs.objects[i];
+        if (object->target && !object->target->mark)
+        {
+            object->target = NULL;
+        }
+    }
+    for (i = 0; i < heap->ephemeron_tables.length; i++)
+    {
+        object = heap->ephemeron_tables.objects[i];
+        for (j = 0; j < object->size; j++)
+        {
+            if (object->table->control[j] < MAP_EMPTY && object->table->slots[2 * j] && !object->table->slots[2 * j]->mark)
+            {
+                remove_slot(object, j);
+            }
+        }
+    }
+    heap->weak_refs.length = 0;
+    heap->ephemeron_tables.length = 0;
+    free(heap->ephemerons.slots);
+    heap->ephemerons.slots = NULL;
+    heap->ephemerons.pending = 0;
+    heap->ephemerons.used = 0;
+    heap->ephemerons.size = 0;
+}
+
+void clear_interned_objects(struct ObjectTable *table)
+{
+    int size = table->size;
+    int count = table->count;
+    int i;
+    for (i = 0; i < table->size; i++)
+    {
+        if (table->objects[i] && !table->objects[i]->mark)
+        {
+            table->objects[i] = NULL;
+            table->count--;
+        }
+    }
+    if (table->count == count)
+    {
+        return;
+    }
+    while (size > INITIAL_OBJECT_TABLE_SIZE && 8 * table->count < size)
+    {
+        size /= 2;
+    }
+    rehash_objects(table, size);
+}
+
+/*
+ * Long-lived programs tend to accumulate many strings with the same
+ * characters, read from the same input or built the same way. If asked to,
+ * the garbage collector deduplicates them, in the spirit of the JVM's G1
+ * collector. Its strings keep their characters in a separate buffer that
+ * duplicates can share; ours keep them inline, so instead we make the
+ * references to duplicates point to one of them, and the others become
+ * garbage.
+ *
+ * Only strings that survived DEDUPLICATION_AGE collections are considered, as
+ * most strings die young and hashing them would be wasted. Interned strings
+ * come first, since their identity matters, and are never replaced. Only
+ * references from objects are replaced: the stacks, handles and programs may be
+ * used by machine code holding their contents in registers, weak references and
+ * ephemeron keys compare by identity, and so do hash-consed pairs. A duplicate
+ * still referenced from one of them simply lives on.
+ *
+ * The age of a replaced string is set to DUPLICATE_AGE, so it is counted only
+ * once, by the collection that replaced it. Its bytes count as saved even if
+ * one of the references above keeps it alive for a while longer.
+ */
+void deduplicate_reference(struct Heap *heap, struct ObjectTable *table, struct Object **reference)
+{
+    struct Object *string = *reference;
+    struct Object *original;
+    if (!string || string->type != STRING || string->age < DEDUPLICATION_AGE || string->interned)
+    {
+        return;
+    }
+    original = find_string(table, string->characters, string->string_length, hash_key(string));
+    if (!original)
+    {
+        add_object(table, string);
+        return;
+    }
+    if (original == string)
+    {
+        return;
+    }
+    *reference = original;
+    if (string->age != DUPLICATE_AGE)
+    {
+        string->age = DUPLICATE_AGE;
+        heap->deduplicated_strings++;
+        heap->deduplicated_bytes += object_size(string);
+    }
+}
+
+void deduplicate_references(struct Heap *heap, struct ObjectTable *table, struct Object *object)
+{
+    int i;
+    for (; object; object = object->next)
+    {
+        if (!object->mark)
+        {
+            continue;
+        }
+        switch (object->type)
+        {
+            case ARRAY:
+                for (i = 0; i < object->length; i++)
+                {
+                    deduplicate_reference(heap, table, &object->array[i]);
+                }
+                break;
+            case EPHEMERON_TABLE:
+                for (i = 0; i < object->size; i++)
+                {
+                    if (!(object->table->control[i] & MAP_EMPTY))
+                    {
+                        deduplicate_reference(heap, table, &object->table->slots[2 * i + 1]);
+                    }
+                }
+                break;
+            case MAP:
+                for (i = 0; i < object->size; i++)
+                {
+                    if (!(object->table->control[i] & MAP_EMPTY))
+                    {
+                        deduplicate_reference(heap, table, &object->table->slots[2 * i]);
+                        deduplicate_reference(heap, table, &object->table->slots[2 * i + 1]);
+                    }
+                }
+                break;
+            case LIST:
+                for (i = 0; i < object->list_length; i++)
+                {
+                    deduplicate_reference(heap, table, &object->heads[i]);
+                }
+                break;
+            case PAIR:
+                if (!object->interned)
+                {
+                    deduplicate_reference(heap, table, &object->head);
+                    deduplicate_reference(heap, table, &object->tail);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+void deduplicate_strings(struct Heap *heap)
+{
+    struct ObjectTable table = {NULL, 0, 0};
+    struct VM *mutator;
+    int i;
+    heap->deduplicated_strings = 0;
+    heap->deduplicated_bytes = 0;
+    for (i = 0; i < heap->interned_strings.size; i++)
+    {
+        if (heap->interned_strings.objects[i])
+        {
+            add_object(&table, heap->interned_strings.objects[i]);
+        }
+    }
+    for (mutator = heap->mutators; mutator; mutator = mutator->next_mutator)
+    {
+        deduplicate_references(heap, &table, mutator->list_of_objects);
+    }
+    deduplicate_references(heap, &table, heap->orphans);
+    deduplicate_references(heap, &table, heap->large_objects);
+    free(table.objects);
+}
+
+void set_string_deduplication(struct Heap *heap, int enabled)
+{
+    heap->deduplicate_strings = enabled;
+}
+
+/*
+ * Tells how many duplicate strings the last collection found and how many
+ * bytes they take. The numbers change during collections, so ask from a
+ * thread that isn't in a safe region.
+ */
+void get_deduplication_statistics(struct Heap *heap, int *strings, size_t *bytes)
+{
+    *strings = heap->deduplicated_strings;
+    *bytes = heap->deduplicated_bytes;
+}
+
+/*
+ * A function that marks all objects on the stack or reachable from the stack,
+ * as well as those held by handles. The literals of the compiled program are
+ * constants, explained further below, that need no marking.
+ */
+void mark(struct VM *vm)
+{
+    struct HandleBlock *block;
+    struct Object **handle;
+    struct Object **end = vm->handle_top;
+    int i;
+    for (i = 0; i < vm->stack_length; i++)
+    {
+        mark_object(vm->heap, vm->stack[i]);
+    }
+    for (block = vm->handle_block; block; block = block->previous)
+    {
+        for (handle = block->handles; handle < end; handle++)
+        {
+            mark_object(vm->heap, *handle);
+        }
+        end = block->previous ? block->previous->handles + HANDLE_BLOCK_SIZE : NULL;
+    }
+}
+
+/*
+ * After calling mark() all reachable objects are marked. Now we need a function
+ * to go through the linked list, unchain unmarked objects and free them. If we
+ * encounter a marked object, we will just remove the mark for the next GC
+ * cycle.
+ *
+ * Nystrom uses a cool trick with a pointer to a pointer here, which is awesome
+ * but also difficult to understand. I go for a more readable approach with an
+ * extra variable "previous".
+ *
+ * We tell what we are going to do before sweeping anything, since printing an
+ * unreachable array prints its elements, which may be unreachable too.
+ */
+void report(struct VM *vm, struct Object *object)
+{
+    while (object)
+    {
+        output_string(vm, object->mark ? "I won't delete this: " : "I will delete this: ");
+        print_object(vm, object);
+        output_char(vm, '\n');
+        object = object->next;
+    }
+}
+
+void sweep(struct Object **list_of_objects, struct VM *owner)
+{
+    struct Object *object = *list_of_objects;
+    struct Object *previous = NULL;
+    struct Object *garbage;
+    while (object)
+    {
+        if (object->mark)
+        {
+            object->mark = 0;
+            if (object->age < DEDUPLICATION_AGE)
+            {
+                object->age++;
+            }
+            previous = object;
+            object = object->next;
+        }
+        else
+        {
+            if (previous)
+            {
+                previous->next = object->next;
+            }
+            else
+            {
+                *list_of_objects = object->next;
+            }
+            garbage = object;
+            object = object->next;
+            delete_object(owner, garbage);
+        }
+    }
+}
+
+/*
+ * To stop the world, we request a safepoint and wait for all other threads
+ * sharing the heap to park, measuring how long that takes. If another thread
+ * got there first, we park until its collection is over. Then we mark from the
+ * roots of every virtual machine and sweep the objects of every virtual
+ * machine, plus those left behind by deleted ones and the large objects,
+ * queueing finalizers and clearing weak references in between. Memory of
+ * deleted small objects goes back to the virtual machine that allocated them.
+ */
+void stop_the_world_mark_and_sweep(struct VM *vm)
+{
+    struct Heap *heap = vm->heap;
+    struct VM *mutator;
+    struct timespec start;
+    struct timespec end;
+    double time;
+    pthread_mutex_lock(&heap->lock);
+    while (atomic_load(&heap->safepoint_requested))
+    {
+        park(vm);
+    }
+    atomic_store(&heap->safepoint_requested, 1);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (heap->stopped_count < heap->mutator_count - 1)
+    {
+        pthread_cond_wait(&heap->stopped, &heap->lock);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    time = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    heap->safepoints++;
+    heap->total_time_to_safepoint += time;
+    if (time > heap->maximum_time_to_safepoint)
+    {
+        heap->maximum_time_to_safepoint = time;
+    }
+    pthread_mutex_unlock(&heap->lock);
+    for (mutator = heap->mutators; mutator; mutator = mutator->next_mutator)
+    {
+        mark(mutator);
+    }
+    queue_finalizers(heap);
+    clear_weak_references(heap);
+    clear_interned_objects(&heap->interned_strings);
+    clear_interned_objects(&heap->hash_consed_pairs);
+    if (heap->deduplicate_strings)
+    {
+        deduplicate_strings(heap);
+    }
+    for (mutator = heap->mutators; mutator; mutator = mutator->next_mutator)
+    {
+        report(vm, mutator->list_of_objects);
+    }
+    report(vm, heap->orphans);
+    report(vm, heap->large_objects);
+    for (mutator = heap->mutators; mutator; mutator = mutator->next_mutator)
+    {
+        sweep(&mutator->list_of_objects, mutator);
+    }
+    sweep(&heap->orphans, vm);
+    sweep(&heap->large_objects, vm);
+    pthread_mutex_lock(&heap->lock);
+    atomic_store(&heap->safepoint_requested, 0);
+    pthread_cond_broadcast(&heap->resumed);
+    pthread_cond_signal(&heap->finalizable);
+    pthread_mutex_unlock(&heap->lock);
+}
+
+/*
+ * Tells how many times the world was stopped so far, and how long it took in
+ * total and at most, in seconds, until every other thread had parked. A long
+ * maximum points at code that runs for a while without reaching a safepoint.
+ */
+void get_safepoint_statistics(struct Heap *heap, int *count, double *total, double *maximum)
+{
+    pthread_mutex_lock(&heap->lock);
+    *count = heap->safepoints;
+    *total = heap->total_time_to_safepoint;
+    *maximum = heap->maximum_time_to_safepoint;
+    pthread_mutex_unlock(&heap->lock);
+}
+
+/*
+ * Creates a virtual machine that will run the given script, allocating from the
+ * given heap or, if it is NULL, from a heap of its own.
+ *
+ * Virtual machines sharing a heap may share objects, since a collection stops
+ * and marks from all of them.
+ */
+struct VM *new_vm(struct Heap *heap, char *code)
+{
+    struct VM *vm = calloc(1, sizeof(struct VM));
+    vm->heap = heap ? heap : new_heap();
+    vm->owns_heap = !heap;
+    vm->code = code;
+    vm->to = code;
+    pthread_mutex_lock(&vm->heap->lock);
+    attach(vm);
+    pthread_mutex_unlock(&vm->heap->lock);
+    return vm;
+}
+
+void hand_over_constants(struct VM *vm)
+{
+    struct ConstantChunk *chunk;
+    while (vm->constants)
+    {
+        chunk = vm->constants;
+        vm->constants = chunk->next;
+        chunk->next = vm->heap->constants;
+        vm->heap->constants = chunk;
+    }
+}
+
+/*
+ * Deletes a virtual machine. With a heap of its own, all its objects are
+ * deleted too, reachable or not. With a shared heap, its objects might still be
+ * reachable from other virtual machines, so they are left to the next
+ * collection, and the memory it no longer needs goes back to the heap for
+ * others to use. They are handed over in the same critical section that
+ * detaches it, after any collection running meanwhile has finished, so that no
+ * collection sees them in neither place or sweeps them while they move.
+ */
+void delete_vm(struct VM *vm)
+{
+    struct Object *object;
+    struct Object *garbage;
+    struct HandleBlock *block;
+    void *memory;
+    int i;
+    flush_output(vm);
+    if (vm->owns_heap)
+    {
+        pthread_mutex_lock(&vm->heap->lock);
+        detach(vm);
+        pthread_mutex_unlock(&vm->heap->lock);
+        stop_finalizer_thread(vm->heap);
+        object = vm->list_of_objects;
+        while (object)
+        {
+            garbage = object;
+            object = object->next;
+            delete_object(vm, garbage);
+        }
+        hand_over_constants(vm);
+        delete_heap(vm->heap);
+    }
+    else
+    {
+        release_tlab(vm);
+        pthread_mutex_lock(&vm->heap->lock);
+        detach(vm);
+        hand_over_constants(vm);
+        object = vm->list_of_objects;
+        while (object)
+        {
+            garbage = object;
+            object = object->next;
+            garbage->next = vm->heap->orphans;
+            vm->heap->orphans = garbage;
+        }
+        for (i = 0; i < SIZE_CLASSES; i++)
+        {
+            while (vm->free_lists[i])
+            {
+                memory = vm->free_lists[i];
+                vm->free_lists[i] = *(void **)memory;
+                *(void **)memory = vm->heap->free_lists[i];
+                vm->heap->free_lists[i] = memory;
+            }
+        }
+        pthread_mutex_unlock(&vm->heap->lock);
+    }
+    while (vm->handle_block)
+    {
+        block = vm->handle_block;
+        vm->handle_block = block->previous;
+        free(block);
+    }
+    free(vm->stack);
+    free(vm->program);
+#ifdef JIT
+    free(vm->jit_buffer);
+    if (vm->jit_code)
+    {
+        munmap((void *)vm->jit_code, vm->jit_code_size);
+    }
+#endif
+    free(vm);
+}
+
+/*
+ * Finalizers don't run during the collection, which would make it take as long
+ * as the slowest finalizer, but afterwards on a finalizer thread, started along
+ * with a virtual machine of its own when the first finalizer is registered.
+ * Between finalizers the thread waits in a safe region, so that collections
+ * don't wait for it, and it only looks at the queue while no collection is
+ * running, since collections change the queue without holding the lock.
+ *
+ * A finalizer is called with the finalizer thread's virtual machine, which it
+ * may use to allocate objects, and the object stays on that machine's stack
+ * until it returns. A finalizer doing slow work without touching the heap
+ * should do so in a safe region too.
+ */
+void *run_finalizers(void *argument)
+{
+    struct VM *vm = argument;
+    struct Heap *heap = vm->heap;
+    struct Finalizer *finalizer;
+    pthread_mutex_lock(&heap->lock);
+    while (1)
+    {
+        heap->stopped_count++;
+        pthread_cond_signal(&heap->stopped);
+        while (atomic_load(&heap->safepoint_requested) || (!heap->finalization_queue && !heap->finalizers_stopping))
+        {
+            pthread_cond_wait(&heap->finalizable, &heap->lock);
+        }
+        heap->stopped_count--;
+        if (!heap->finalization_queue)
+        {
+            break;
+        }
+        finalizer = heap->finalization_queue;
+        heap->finalization_queue = finalizer->next;
+        push(vm, finalizer->object);
+        pthread_mutex_unlock(&heap->lock);
+        finalizer->function(vm, finalizer->object, finalizer->data);
+        pop(vm);
+        free(finalizer);
+        pthread_mutex_lock(&heap->lock);
+    }
+    pthread_mutex_unlock(&heap->lock);
+    return NULL;
+}
+
+/*
+ * Registers a finalizer to be called with the given data once the object has
+ * become unreachable. The finalizer is registered before we park for a pending
+ * collection, since the object might be reachable from nowhere else yet.
+ */
+void register_finalizer(struct VM *vm, struct Object *object, void (*function)(struct VM *vm, struct Object *object, void *data), void *data)
+{
+    struct Heap *heap = vm->heap;
+    struct Finalizer *finalizer = malloc(sizeof(struct Finalizer));
+    finalizer->object = object;
+    finalizer->function = function;
+    finalizer->data = data;
+    pthread_mutex_lock(&heap->lock);
+    finalizer->next = heap->finalizers;
+    heap->finalizers = finalizer;
+    while (atomic_load(&heap->safepoint_requested))
+    {
+        park(vm);
+    }
+    if (!heap->finalizer_vm)
+    {
+        heap->finalizer_vm = calloc(1, sizeof(struct VM));
+        heap->finalizer_vm->heap = heap;
+        attach(heap->finalizer_vm);
+        pthread_create(&heap->finalizer_thread, NULL, run_finalizers, heap->finalizer_vm);
+    }
+    pthread_mutex_unlock(&heap->lock);
+}
+
+/*
+ * Stops the finalizer thread once it has emptied the finalization queue. The
+ * finalizers of objects that are still reachable are not called.
+ */
+void stop_finalizer_thread(struct Heap *heap)
+{
+    pthread_mutex_lock(&heap->lock);
+    if (!heap->finalizer_vm)
+    {
+        pthread_mutex_unlock(&heap->lock);
+        return;
+    }
+    heap->finalizers_stopping = 1;
+    pthread_cond_signal(&heap->finalizable);
+    pthread_mutex_unlock(&heap->lock);
+    pthread_join(heap->finalizer_thread, NULL);
+    delete_vm(heap->finalizer_vm);
+    heap->finalizer_vm = NULL;
+}
+
+/*
+ * Now let's implement a simple stack-oriented language with the following
+ * features:
+ * - literal numbers are pushed onto the stack.
+ * - "add", "sub", "mul", "div" and "mod" pop two operands from the stack,
+ *   perform an arithmetic operation and push the result onto the stack.
+ * - "pop" pops a value from the stack.
+ * - "print" prints the top of the stack without popping it.
+ * - "null" pushes a null pointer onto the stack.
+ * - "cons" pops two values from the stack, constructs a pair and pushes it onto
+ *   the stack.
+ * - "vector" pops a count n, then pops n numbers and pushes a float array of
+ *   them.
+ * - "vadd", "vsub", "vmul" and "vdiv" pop two float arrays and push a float
+ *   array of the element-wise results.
+ * - "vsum" pops a float array and pushes the sum of its elements, "vdot" pops
+ *   two float arrays and pushes their dot product.
+ * - literal strings in double quotes are pushed onto the stack.
+ * - "array" pops a number and pushes an empty array with room for that many
+ *   elements.
+ * - "append" pops a value and appends it to the array below it, which stays on
+ *   the stack.
+ * - "get" pops an index and an array and pushes the element at that index, or
+ *   null if there is none.
+ * - "set" pops a value and an index and stores the value at that index in the
+ *   array below them, which stays on the stack.
+ * - "map" pushes an empty map.
+ * - "get" and "set" work on maps as well, with keys instead of indexes. Getting
+ *   a key that isn't in the map pushes null.
+ * - "length" pops an array, float array, map or string and pushes its length.
+ */
+enum TokenType
+{
+    ADD_TOKEN,
+    APPEND_TOKEN,
+    ARRAY_TOKEN,
+    CONS_TOKEN,
+    DIV_TOKEN,
+    END_TOKEN,
+    GET_TOKEN,
+    LENGTH_TOKEN,
+    MAP_TOKEN,
+    MOD_TOKEN,
+    MUL_TOKEN,
+    NULL_TOKEN,
+    NUMBER_TOKEN,
+    POP_TOKEN,
+    PRINT_TOKEN,
+    SET_TOKEN,
+    STRING_TOKEN,
+    SUB_TOKEN,
+    VADD_TOKEN,
+    VDIV_TOKEN,
+    VDOT_TOKEN,
+    VECTOR_TOKEN,
+    VMUL_TOKEN,
+    VSUB_TOKEN,
+    VSUM_TOKEN
+};
+
+struct Token
+{
+    enum TokenType type;
     struct Object *value;
 };
 
+/*
+ * The literals of a program are needed for as long as the program may run, so
+ * there is no point in marking and sweeping them. They are constants instead,
+ * allocated by bumping a pointer through chunks of memory that belong to no
+ * list of objects, so sweep() never visits them. They are marked for good, so
+ * mark() stops at them and need not look at the program at all. Small integers
+ * come from the cache of the heap as usual.
+ *
+ * Once the program is compiled, the chunks are made read-only. Nothing writes
+ * to a marked number or to a string too young to be deduplicated, so any
+ * write to a literal is a bug, and now a crash rather than a silent change of
+ * the program. Objects of other virtual machines may still reference the
+ * constants after their virtual machine is deleted, so the chunks are then
+ * handed to the heap, which unmaps them when it is deleted itself.
+ */
+struct Object *new_constant(struct VM *vm, size_t size)
+{
+    struct ConstantChunk *chunk = vm->constants;
+    struct Object *object;
+    size_t chunk_size;
+    size = (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    if (!chunk || (size_t)(chunk->end - chunk->top) < size)
+    {
+        chunk_size = size > CONSTANT_CHUNK_SIZE ? size : CONSTANT_CHUNK_SIZE;
+        chunk = malloc(sizeof(struct ConstantChunk));
+        chunk->memory = mmap(NULL, chunk_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk->memory == MAP_FAILED)
+        {
+            out_of_memory(vm);
+        }
+        chunk->top = chunk->memory;
+        chunk->end = chunk->memory + chunk_size;
+        chunk->next = vm->constants;
+        vm->constants = chunk;
+    }
+    object = (struct Object *)chunk->top;
+    chunk->top += size;
+    object->mark = 1;
+    return object;
+}
+
+struct Object *new_constant_number(struct VM *vm, double number)
+{
+    struct Object *object;
+    if (is_small_integer(number))
+    {
+        return new_number(vm, number);
+    }
+    object = new_constant(vm, sizeof(struct Object));
+    object->type = NUMBER;
+    object->number = number;
+    return object;
+}
+
+struct Object *new_constant_string(struct VM *vm, char *characters, int length)
+{
+    struct Object *object = new_constant(vm, offsetof(struct Object, characters) + length + 1);
+    object->type = STRING;
+    object->string_length = length;
+    memcpy(object->characters, characters, length);
+    object->characters[length] = '\0';
+    return object;
+}
+
+/*
+ * Makes the constants allocated so far read-only. Chunks are left full, so
+ * that later constants go to new ones.
+ */
+void protect_constants(struct VM *vm)
+{
+    struct ConstantChunk *chunk;
+    for (chunk = vm->constants; chunk; chunk = chunk->next)
+    {
+        if (chunk->top != chunk->end)
+        {
+            mprotect(chunk->memory, chunk->end - chunk->memory, PROT_READ);
+            chunk->top = chunk->end;
+        }
+    }
+}
+
 char code[] = "1 2 add 3 mul print pop 1 2 3 null cons cons cons print";
-char *to = code;
-char *from;
 
 /*
- * This implementation lacks checks to handle syntax and runtime errors because
- * it is only a demonstration. Of course a real language should have such
- * checks.
+ * This implementation lacks checks to handle syntax and runtime errors because
+ * it is only a demonstration. Of course a real language should have such
+ * checks.
+ */
+struct Token next_token(struct VM *vm)
+{
+    struct Token token;
+    char substring[256];
+    vm->from = vm->to;
+    if (*vm->to == '\0')
+    {
+        token.type = END_TOKEN;
+    }
+    else if ((*vm->to >= '\t' && *vm->to <= '\r') || *vm->to == ' ')
+    {
+        vm->to++;
+        while ((*vm->to >= '\t' && *vm->to <= '\r') || *vm->to == ' ')
+        {
+            vm->to++;
+        }
+        return next_token(vm);
+    }
+    else if (*vm->to == '+' || *vm->to == '-' || (*vm->to >= '0' && *vm->to <= '9'))
+    {
+        vm->to++;
+        while (*vm->to >= '0' && *vm->to <= '9')
+        {
+            vm->to++;
+        }
+        if (*vm->to == '.')
+        {
+            vm->to++;
+            while (*vm->to >= '0' && *vm->to <= '9')
+            {
+                vm->to++;
+            }
+        }
+        if (*vm->to == 'E' || *vm->to == 'e')
+        {
+            vm->to++;
+            if (*vm->to == '+' || *vm->to == '-')
+            {
+                vm->to++;
+            }
+            while (*vm->to >= '0' && *vm->to <= '9')
+            {
+                vm->to++;
+            }
+        }
+        strncpy(substring, vm->from, vm->to - vm->from);
+        substring[vm->to - vm->from] = '\0';
+        token.type = NUMBER_TOKEN;
+        token.value = new_constant_number(vm, atof(substring));
+    }
+    else if (*vm->to == '"')
+    {
+        vm->to++;
+        while (*vm->to != '"' && *vm->to != '\0')
+        {
+            vm->to++;
+        }
+        token.type = STRING_TOKEN;
+        token.value = new_constant_string(vm, vm->from + 1, vm->to - vm->from - 1);
+        if (*vm->to == '"')
+        {
+            vm->to++;
+        }
+    }
+    else if (*vm->to >= 'a' && *vm->to <= 'z')
+    {
+        vm->to++;
+        while (*vm->to >= 'a' && *vm->to <= 'z')
+        {
+            vm->to++;
+        }
+        strncpy(substring, vm->from, vm->to - vm->from);
+        substring[vm->to - vm->from] = '\0';
+        if (strcmp(substring, "add") == 0)
+        {
+            token.type = ADD_TOKEN;
+        }
+        else if (strcmp(substring, "append") == 0)
+        {
+            token.type = APPEND_TOKEN;
+        }
+        else if (strcmp(substring, "array") == 0)
+        {
+            token.type = ARRAY_TOKEN;
+        }
+        else if (strcmp(substring, "cons") == 0)
+        {
+            token.type = CONS_TOKEN;
+        }
+        else if (strcmp(substring, "div") == 0)
+        {
+            token.type = DIV_TOKEN;
+        }
+        else if (strcmp(substring, "get") == 0)
+        {
+            token.type = GET_TOKEN;
+        }
+        else if (strcmp(substring, "length") == 0)
+        {
+            token.type = LENGTH_TOKEN;
+        }
+        else if (strcmp(substring, "map") == 0)
+        {
+            token.type = MAP_TOKEN;
+        }
+        else if (strcmp(substring, "mod") == 0)
+        {
+            token.type = MOD_TOKEN;
+        }
+        else if (strcmp(substring, "mul") == 0)
+        {
+            token.type = MUL_TOKEN;
+        }
+        else if (strcmp(substring, "null") == 0)
+        {
+            token.type = NULL_TOKEN;
+        }
+        else if (strcmp(substring, "pop") == 0)
+        {
+            token.type = POP_TOKEN;
+        }
+        else if (strcmp(substring, "print") == 0)
+        {
+            token.type = PRINT_TOKEN;
+        }
+        else if (strcmp(substring, "set") == 0)
+        {
+            token.type = SET_TOKEN;
+        }
+        else if (strcmp(substring, "sub") == 0)
+        {
+            token.type = SUB_TOKEN;
+        }
+        else if (strcmp(substring, "vadd") == 0)
+        {
+            token.type = VADD_TOKEN;
+        }
+        else if (strcmp(substring, "vdiv") == 0)
+        {
+            token.type = VDIV_TOKEN;
+        }
+        else if (strcmp(substring, "vdot") == 0)
+        {
+            token.type = VDOT_TOKEN;
+        }
+        else if (strcmp(substring, "vector") == 0)
+        {
+            token.type = VECTOR_TOKEN;
+        }
+        else if (strcmp(substring, "vmul") == 0)
+        {
+            token.type = VMUL_TOKEN;
+        }
+        else if (strcmp(substring, "vsub") == 0)
+        {
+            token.type = VSUB_TOKEN;
+        }
+        else if (strcmp(substring, "vsum") == 0)
+        {
+            token.type = VSUM_TOKEN;
+        }
+    }
+    return token;
+}
+
+/*
+ * Interpreting the token stream directly means that every run of a script
+ * lexes it again, allocates a fresh number object for every literal and
+ * dispatches once per token. Instead we compile the script into a program, an
+ * array of instructions, and run the program.
+ *
+ * While compiling we apply a few peephole optimizations, looking only at the
+ * last instructions emitted so far:
+ * - Arithmetic on two literals is folded into a single literal, so
+ *   "1 2 add 3 mul" compiles to the literal 9.
+ * - Arithmetic with a literal right operand becomes a superinstruction that
+ *   carries the literal, e.g. "x 3 add" compiles to ADD_NUMBER_OP 3.
+ * - A chain of conses ending in null becomes a single LIST_OP, so
+ *   "1 2 3 null cons cons cons" compiles to three literals and LIST_OP 3,
+ *   which builds a compact list rather than three pairs.
+ * - "print pop" becomes PRINT_POP_OP and a literal or null immediately popped
+ *   again is dropped altogether.
+ * - A literal capacity for "array" or index for "get" is stored unboxed in the
+ *   instruction, e.g. "a 2 get" compiles to GET_NUMBER_OP 2.
+ *
+ * Our language has no jumps, so every instruction emitted so far is
+ * guaranteed to execute right before the one we are about to emit, which is
+ * what makes these rewrites safe.
+ */
+enum Opcode
+{
+    ADD_OP,
+    ADD_NUMBER_OP,
+    APPEND_OP,
+    ARRAY_OP,
+    ARRAY_NUMBER_OP,
+    CONS_OP,
+    DIV_OP,
+    DIV_NUMBER_OP,
+    END_OP,
+    GET_OP,
+    GET_NUMBER_OP,
+    LENGTH_OP,
+    LIST_OP,
+    MAP_OP,
+    MOD_OP,
+    MOD_NUMBER_OP,
+    MUL_OP,
+    MUL_NUMBER_OP,
+    NULL_OP,
+    NUMBER_OP,
+    POP_OP,
+    PRINT_OP,
+    PRINT_POP_OP,
+    SET_OP,
+    STRING_OP,
+    SUB_OP,
+    SUB_NUMBER_OP,
+    VADD_OP,
+    VDIV_OP,
+    VDOT_OP,
+    VECTOR_OP,
+    VMUL_OP,
+    VSUB_OP,
+    VSUM_OP
+};
+
+struct Instruction
+{
+    enum Opcode opcode;
+    int count;
+    struct Object *value;
+};
+
+void emit(struct VM *vm, enum Opcode opcode, int count, struct Object *value)
+{
+    if (vm->program_length == vm->program_size)
+    {
+        vm->program_size = vm->program_size ? vm->program_size * 2 : INITIAL_PROGRAM_SIZE;
+        vm->program = realloc(vm->program, vm->program_size * sizeof(struct Instruction));
+    }
+    vm->program[vm->program_length].opcode = opcode;
+    vm->program[vm->program_length].count = count;
+    vm->program[vm->program_length].value = value;
+    vm->program_length++;
+}
+
+/*
+ * Returns the opcode of the instruction "distance" places before the end of
+ * the program, or END_OP if there is no such instruction.
+ */
+enum Opcode last_opcode(struct VM *vm, int distance)
+{
+    if (distance > vm->program_length)
+    {
+        return END_OP;
+    }
+    return vm->program[vm->program_length - distance].opcode;
+}
+
+double fold(enum Opcode opcode, double operand1, double operand2)
+{
+    switch (opcode)
+    {
+        case ADD_OP:
+            return operand1 + operand2;
+        case DIV_OP:
+            return operand1 / operand2;
+        case MOD_OP:
+            return fmod(operand1, operand2);
+        case MUL_OP:
+            return operand1 * operand2;
+        default:
+            return operand1 - operand2;
+    }
+}
+
+/*
+ * Emits an instruction taking an integer operand, using "number_opcode" with
+ * the operand stored in "count" if it is a literal.
+ */
+void emit_integer(struct VM *vm, enum Opcode opcode, enum Opcode number_opcode)
+{
+    if (last_opcode(vm, 1) == NUMBER_OP)
+    {
+        vm->program[vm->program_length - 1].opcode = number_opcode;
+        vm->program[vm->program_length - 1].count = vm->program[vm->program_length - 1].value->number;
+    }
+    else
+    {
+        emit(vm, opcode, 0, NULL);
+    }
+}
+
+/*
+ * Emits an arithmetic instruction. "number_opcode" is the superinstruction
+ * used when the right operand is a literal.
+ */
+void emit_arithmetic(struct VM *vm, enum Opcode opcode, enum Opcode number_opcode)
+{
+    double operand1;
+    double operand2;
+    if (last_opcode(vm, 1) == NUMBER_OP && last_opcode(vm, 2) == NUMBER_OP)
+    {
+        operand1 = vm->program[vm->program_length - 2].value->number;
+        operand2 = vm->program[vm->program_length - 1].value->number;
+        vm->program_length -= 2;
+        emit(vm, NUMBER_OP, 0, new_constant_number(vm, fold(opcode, operand1, operand2)));
+    }
+    else if (last_opcode(vm, 1) == NUMBER_OP)
+    {
+        vm->program[vm->program_length - 1].opcode = number_opcode;
+    }
+    else
+    {
+        emit(vm, opcode, 0, NULL);
+    }
+}
+
+void compile(struct VM *vm)
+{
+    struct Token token;
+    while (1)
+    {
+        token = next_token(vm);
+        switch (token.type)
+        {
+            case ADD_TOKEN:
+                emit_arithmetic(vm, ADD_OP, ADD_NUMBER_OP);
+                break;
+            case APPEND_TOKEN:
+                emit(vm, APPEND_OP, 0, NULL);
+                break;
+            case ARRAY_TOKEN:
+                emit_integer(vm, ARRAY_OP, ARRAY_NUMBER_OP);
+                break;
+            case CONS_TOKEN:
+                if (last_opcode(vm, 1) == NULL_OP)
+                {
+                    vm->program[vm->program_length - 1].opcode = LIST_OP;
+                    vm->program[vm->program_length - 1].count = 1;
+                }
+                else if (last_opcode(vm, 1) == LIST_OP)
+                {
+                    vm->program[vm->program_length - 1].count++;
+                }
+                else
+                {
+                    emit(vm, CONS_OP, 0, NULL);
+                }
+                break;
+            case DIV_TOKEN:
+                emit_arithmetic(vm, DIV_OP, DIV_NUMBER_OP);
+                break;
+            case END_TOKEN:
+                emit(vm, END_OP, 0, NULL);
+                protect_constants(vm);
+                return;
+            case GET_TOKEN:
+                emit_integer(vm, GET_OP, GET_NUMBER_OP);
+                break;
+            case LENGTH_TOKEN:
+                emit(vm, LENGTH_OP, 0, NULL);
+                break;
+            case MAP_TOKEN:
+                emit(vm, MAP_OP, 0, NULL);
+                break;
+            case MOD_TOKEN:
+                emit_arithmetic(vm, MOD_OP, MOD_NUMBER_OP);
+                break;
+            case MUL_TOKEN:
+                emit_arithmetic(vm, MUL_OP, MUL_NUMBER_OP);
+                break;
+            case NULL_TOKEN:
+                emit(vm, NULL_OP, 0, NULL);
+                break;
+            case NUMBER_TOKEN:
+                emit(vm, NUMBER_OP, 0, token.value);
+                break;
+            case POP_TOKEN:
+                if (last_opcode(vm, 1) == NUMBER_OP || last_opcode(vm, 1) == NULL_OP || last_opcode(vm, 1) == STRING_OP)
+                {
+                    vm->program_length--;
+                }
+                else if (last_opcode(vm, 1) == PRINT_OP)
+                {
+                    vm->program[vm->program_length - 1].opcode = PRINT_POP_OP;
+                }
+                else
+                {
+                    emit(vm, POP_OP, 0, NULL);
+                }
+                break;
+            case PRINT_TOKEN:
+                emit(vm, PRINT_OP, 0, NULL);
+                break;
+            case SET_TOKEN:
+                emit(vm, SET_OP, 0, NULL);
+                break;
+            case STRING_TOKEN:
+                emit(vm, STRING_OP, 0, token.value);
+                break;
+            case SUB_TOKEN:
+                emit_arithmetic(vm, SUB_OP, SUB_NUMBER_OP);
+                break;
+            case VADD_TOKEN:
+                emit(vm, VADD_OP, 0, NULL);
+                break;
+            case VDIV_TOKEN:
+                emit(vm, VDIV_OP, 0, NULL);
+                break;
+            case VDOT_TOKEN:
+                emit(vm, VDOT_OP, 0, NULL);
+                break;
+            case VECTOR_TOKEN:
+                emit(vm, VECTOR_OP, 0, NULL);
+                break;
+            case VMUL_TOKEN:
+                emit(vm, VMUL_OP, 0, NULL);
+                break;
+            case VSUB_TOKEN:
+                emit(vm, VSUB_OP, 0, NULL);
+                break;
+            case VSUM_TOKEN:
+                emit(vm, VSUM_OP, 0, NULL);
+                break;
+        }
+    }
+}
+
+/*
+ * Executes the instructions on arrays, float arrays and strings. Operands stay
+ * on the stack until the result has been allocated, so that they remain
+ * reachable. The JIT calls this function too.
  */
-struct Token next_token(void)
+int length_of(struct Object *object)
 {
-    struct Token token;
-    char substring[256];
-    from = to;
-    if (*to == '\0')
+    switch (object->type)
     {
-        token.type = END_TOKEN;
+        case ARRAY:
+        case FLOAT_ARRAY:
+            return object->length;
+        case MAP:
+            return object->length;
+        case STRING:
+            return object->string_length;
+        default:
+            return 0;
     }
-    else if ((*to >= '\t' && *to <= '\r') || *to == ' ')
+}
+
+struct Object *get_element_or_null(struct Object *array, int index)
+{
+    if (index < 0 || index >= array->length)
     {
-        to++;
-        while ((*to >= '\t' && *to <= '\r') || *to == ' ')
-        {
-            to++;
-        }
-        return next_token();
+        return NULL;
     }
-    else if (*to == '+' || *to == '-' || (*to >= '0' && *to <= '9'))
+    return get_element(array, index);
+}
+
+/*
+ * Replaces the two topmost values of the stack with a pair of them. They stay
+ * on the stack while the pair is allocated, since allocating may collect
+ * garbage.
+ */
+void cons(struct VM *vm)
+{
+    struct Object *pair = cons_pair(vm, vm->stack[vm->stack_length - 2], peek(vm));
+    pop(vm);
+    pop(vm);
+    push(vm, pair);
+}
+
+void execute_collection(struct VM *vm, struct Instruction *instruction)
+{
+    int i;
+    int count;
+    struct Object *result = NULL;
+    switch (instruction->opcode)
     {
-        to++;
-        while (*to >= '0' && *to <= '9')
-        {
-            to++;
-        }
-        if (*to == '.')
-        {
-            to++;
-            while (*to >= '0' && *to <= '9')
+        case APPEND_OP:
+            append_element(vm, vm->stack[vm->stack_length - 2], peek(vm));
+            pop(vm);
+            return;
+        case ARRAY_OP:
+            result = new_array_of_size(vm, peek(vm)->number);
+            pop(vm);
+            push(vm, result);
+            return;
+        case ARRAY_NUMBER_OP:
+            push(vm, new_array_of_size(vm, instruction->count));
+            return;
+        case GET_OP:
+            result = vm->stack[vm->stack_length - 2];
+            if (result->type == MAP)
             {
-                to++;
+                result = get_from_map(result, peek(vm));
             }
-        }
-        if (*to == 'E' || *to == 'e')
-        {
-            to++;
-            if (*to == '+' || *to == '-')
+            else
             {
-                to++;
+                result = get_element_or_null(result, peek(vm)->number);
             }
-            while (*to >= '0' && *to <= '9')
+            break;
+        case GET_NUMBER_OP:
+            result = pop(vm);
+            if (result->type == MAP)
             {
-                to++;
+                push(vm, get_from_map(result, instruction->value));
             }
-        }
-        strncpy(substring, from, to - from);
-        substring[to - from] = '\0';
-        token.type = NUMBER_TOKEN;
-        token.value = new_number(atof(substring));
-    }
-    else if (*to >= 'a' && *to <= 'z')
-    {
-        to++;
-        while (*to >= 'a' && *to <= 'z')
-        {
-            to++;
-        }
-        strncpy(substring, from, to - from);
-        substring[to - from] = '\0';
-        if (strcmp(substring, "add") == 0)
-        {
-            token.type = ADD_TOKEN;
-        }
-        else if (strcmp(substring, "cons") == 0)
-        {
-            token.type = CONS_TOKEN;
-        }
-        else if (strcmp(substring, "div") == 0)
-        {
-            token.type = DIV_TOKEN;
-        }
-        else if (strcmp(substring, "mod") == 0)
-        {
-            token.type = MOD_TOKEN;
-        }
-        else if (strcmp(substring, "mul") == 0)
-        {
-            token.type = MUL_TOKEN;
-        }
-        else if (strcmp(substring, "null") == 0)
-        {
-            token.type = NULL_TOKEN;
-        }
-        else if (strcmp(substring, "pop") == 0)
-        {
-            token.type = POP_TOKEN;
-        }
-        else if (strcmp(substring, "print") == 0)
-        {
-            token.type = PRINT_TOKEN;
-        }
-        else if (strcmp(substring, "sub") == 0)
-        {
-            token.type = SUB_TOKEN;
-        }
+            else
+            {
+                push(vm, get_element_or_null(result, instruction->count));
+            }
+            return;
+        case LENGTH_OP:
+            result = new_number(vm, length_of(peek(vm)));
+            pop(vm);
+            push(vm, result);
+            return;
+        case LIST_OP:
+            if (vm->heap->hash_cons_pairs)
+            {
+                push(vm, NULL);
+                for (i = 0; i < instruction->count; i++)
+                {
+                    cons(vm);
+                }
+                return;
+            }
+            result = new_list(vm, vm->stack + vm->stack_length - instruction->count, instruction->count, NULL);
+            for (i = 0; i < instruction->count; i++)
+            {
+                pop(vm);
+            }
+            push(vm, result);
+            return;
+        case MAP_OP:
+            push(vm, new_map(vm));
+            return;
+        case SET_OP:
+            if (vm->stack[vm->stack_length - 3]->type == MAP)
+            {
+                set_in_map(vm->stack[vm->stack_length - 3], vm->stack[vm->stack_length - 2], peek(vm));
+                pop(vm);
+                pop(vm);
+                return;
+            }
+            result = pop(vm);
+            count = pop(vm)->number;
+            if (count >= 0 && count < peek(vm)->length)
+            {
+                set_element(peek(vm), count, result);
+            }
+            return;
+        case VADD_OP:
+            result = combine_floats(vm, '+', vm->stack[vm->stack_length - 2], peek(vm));
+            break;
+        case VDIV_OP:
+            result = combine_floats(vm, '/', vm->stack[vm->stack_length - 2], peek(vm));
+            break;
+        case VDOT_OP:
+            result = new_number(vm, dot_floats(vm->stack[vm->stack_length - 2], peek(vm)));
+            break;
+        case VECTOR_OP:
+            count = pop(vm)->number;
+            result = new_float_array(vm, count);
+            for (i = count - 1; i >= 0; i--)
+            {
+                result->floats[i] = pop(vm)->number;
+            }
+            push(vm, result);
+            return;
+        case VMUL_OP:
+            result = combine_floats(vm, '*', vm->stack[vm->stack_length - 2], peek(vm));
+            break;
+        case VSUB_OP:
+            result = combine_floats(vm, '-', vm->stack[vm->stack_length - 2], peek(vm));
+            break;
+        case VSUM_OP:
+            result = new_number(vm, sum_floats(peek(vm)));
+            pop(vm);
+            push(vm, result);
+            return;
+        default:
+            return;
     }
-    return token;
+    pop(vm);
+    pop(vm);
+    push(vm, result);
 }
 
-void interpret(void)
+void interpret(struct VM *vm)
 {
-    struct Token token;
+    struct Instruction *instruction = vm->program;
     struct Object *operand1;
     struct Object *operand2;
     while (1)
     {
-        token = next_token();
-        switch (token.type)
+        poll_safepoint(vm);
+        switch (instruction->opcode)
         {
-            case ADD_TOKEN:
-                operand2 = pop();
-                operand1 = pop();
-                push(new_number(operand1->number + operand2->number));
+            case ADD_OP:
+                operand2 = pop(vm);
+                operand1 = pop(vm);
+                push(vm, new_number(vm, operand1->number + operand2->number));
                 break;
-            case CONS_TOKEN:
-                operand2 = pop();
-                operand1 = pop();
-                push(new_pair(operand1, operand2));
+            case ADD_NUMBER_OP:
+                operand1 = pop(vm);
+                push(vm, new_number(vm, operand1->number + instruction->value->number));
                 break;
-            case DIV_TOKEN:
-                operand2 = pop();
-                operand1 = pop();
-                push(new_number(operand1->number / operand2->number));
+            case CONS_OP:
+                cons(vm);
                 break;
-            case END_TOKEN:
+            case DIV_OP:
+                operand2 = pop(vm);
+                operand1 = pop(vm);
+                push(vm, new_number(vm, operand1->number / operand2->number));
+                break;
+            case DIV_NUMBER_OP:
+                operand1 = pop(vm);
+                push(vm, new_number(vm, operand1->number / instruction->value->number));
+                break;
+            case END_OP:
                 return;
-            case MOD_TOKEN:
-                operand2 = pop();
-                operand1 = pop();
-                push(new_number(fmod(operand1->number, operand2->number)));
+            case MOD_OP:
+                operand2 = pop(vm);
+                operand1 = pop(vm);
+                push(vm, new_number(vm, fmod(operand1->number, operand2->number)));
                 break;
-            case MUL_TOKEN:
-                operand2 = pop();
-                operand1 = pop();
-                push(new_number(operand1->number * operand2->number));
+            case MOD_NUMBER_OP:
+                operand1 = pop(vm);
+                push(vm, new_number(vm, fmod(operand1->number, instruction->value->number)));
                 break;
-            case NULL_TOKEN:
-                push(NULL);
+            case MUL_OP:
+                operand2 = pop(vm);
+                operand1 = pop(vm);
+                push(vm, new_number(vm, operand1->number * operand2->number));
                 break;
-            case NUMBER_TOKEN:
-                push(token.value);
+            case MUL_NUMBER_OP:
+                operand1 = pop(vm);
+                push(vm, new_number(vm, operand1->number * instruction->value->number));
                 break;
-            case POP_TOKEN:
-                pop();
+            case NULL_OP:
+                push(vm, NULL);
                 break;
-            case PRINT_TOKEN:
-                print_object(peek());
-                putchar('\n');
+            case NUMBER_OP:
+            case STRING_OP:
+                push(vm, instruction->value);
                 break;
-            case SUB_TOKEN:
-                operand2 = pop();
-                operand1 = pop();
-                push(new_number(operand1->number - operand2->number));
+            case POP_OP:
+                pop(vm);
+                break;
+            case PRINT_OP:
+                print_object(vm, peek(vm));
+                output_char(vm, '\n');
+                break;
+            case PRINT_POP_OP:
+                print_object(vm, pop(vm));
+                output_char(vm, '\n');
+                break;
+            case SUB_OP:
+                operand2 = pop(vm);
+                operand1 = pop(vm);
+                push(vm, new_number(vm, operand1->number - operand2->number));
+                break;
+            case SUB_NUMBER_OP:
+                operand1 = pop(vm);
+                push(vm, new_number(vm, operand1->number - instruction->value->number));
                 break;
+            case APPEND_OP:
+            case ARRAY_OP:
+            case ARRAY_NUMBER_OP:
+            case GET_OP:
+            case GET_NUMBER_OP:
+            case LENGTH_OP:
+            case LIST_OP:
+            case MAP_OP:
+            case SET_OP:
+            case VADD_OP:
+            case VDIV_OP:
+            case VDOT_OP:
+            case VECTOR_OP:
+            case VMUL_OP:
+            case VSUB_OP:
+            case VSUM_OP:
+                execute_collection(vm, instruction);
+                break;
+        }
+        instruction++;
+    }
+}
+
+/*
+ * For scripts run over and over again even the dispatch in interpret() costs
+ * more than the actual work. On x86-64 Linux we can instead translate the
+ * program into machine code, gluing together a fixed template of instructions
+ * per opcode. This is the simplest kind of JIT compiler, often called a
+ * baseline or template JIT.
+ *
+ * The generated code keeps the address of the next free stack slot in rbx, the
+ * start of the stack in r12, the address of stack_length in r13, the end of the
+ * stack in r14 and the virtual machine in r15. These are callee-saved
+ * registers, so they survive calls into C. The machine code belongs to one
+ * virtual machine, whose addresses are built into it. Pushing a literal or null
+ * and popping are done in registers only; we call into C to allocate numbers
+ * and pairs, to print and to grow the stack. Operations on vectors, arrays,
+ * maps and lists are not worth a template of their own: emit_call_back() calls
+ * execute_collection(), the same code the interpreter runs for them. Before
+ * every call into C stack_length is written back, so the garbage collector
+ * always sees the correct roots. Whenever C may have moved the stack, we reload
+ * r12, r14 and rbx.
+ *
+ * Every template starts with a safepoint poll, just as the interpreter polls
+ * before every instruction: it checks the heap's safepoint_requested flag and
+ * only calls safepoint() if it is set. Without it, code that allocates nothing
+ * but cached numbers would never stop for another thread's collection.
+ *
+ * The JIT is opt-in: set the environment variable GC_JIT to use it. Otherwise,
+ * and on other platforms, we fall back to the interpreter. To let perf
+ * attribute samples to JIT code, every template is listed in
+ * /tmp/perf-<pid>.map.
+ */
+#ifdef JIT
+char *opcode_names[] =
+{
+    "add",
+    "add_number",
+    "append",
+    "array",
+    "array_number",
+    "cons",
+    "div",
+    "div_number",
+    "end",
+    "get",
+    "get_number",
+    "length",
+    "list",
+    "map",
+    "mod",
+    "mod_number",
+    "mul",
+    "mul_number",
+    "null",
+    "number",
+    "pop",
+    "print",
+    "print_pop",
+    "set",
+    "string",
+    "sub",
+    "sub_number",
+    "vadd",
+    "vdiv",
+    "vdot",
+    "vector",
+    "vmul",
+    "vsub",
+    "vsum"
+};
+
+void emit_bytes(struct VM *vm, char *bytes, int count)
+{
+    while (vm->jit_length + count > vm->jit_size)
+    {
+        vm->jit_size = vm->jit_size ? vm->jit_size * 2 : 4096;
+        vm->jit_buffer = realloc(vm->jit_buffer, vm->jit_size);
+    }
+    memcpy(vm->jit_buffer + vm->jit_length, bytes, count);
+    vm->jit_length += count;
+}
+
+void emit_quad(struct VM *vm, uint64_t quad)
+{
+    emit_bytes(vm, (char *)&quad, sizeof(quad));
+}
+
+/* movabs rax, quad */
+void emit_load_rax(struct VM *vm, uint64_t quad)
+{
+    emit_bytes(vm, "\x48\xb8", 2);
+    emit_quad(vm, quad);
+}
+
+/* stack_length = (rbx - r12) / 8; mov rdi, r15; movabs rax, function; call rax */
+void emit_call(struct VM *vm, uint64_t function)
+{
+    emit_bytes(vm, "\x48\x89\xd9\x4c\x29\xe1\x48\xc1\xf9\x03\x41\x89\x4d\x00", 14);
+    emit_bytes(vm, "\x4c\x89\xff", 3);
+    emit_load_rax(vm, function);
+    emit_bytes(vm, "\xff\xd0", 2);
+}
+
+/* sub rbx, 8 * count; mov [rbx], rax; add rbx, 8 */
+void emit_replace_operands(struct VM *vm, int count)
+{
+    char bytes[] = "\x48\x83\xeb\x00\x48\x89\x03\x48\x83\xc3\x08";
+    bytes[3] = 8 * count;
+    emit_bytes(vm, bytes, 11);
+}
+
+/*
+ * Loads the number of the second topmost stack slot into xmm0 and the number of
+ * the topmost stack slot (or the literal of a superinstruction) into xmm1.
+ */
+void emit_load_operands(struct VM *vm, struct Instruction *instruction)
+{
+    char load_xmm0[] = "\xf2\x0f\x10\x40\x00";
+    char load_xmm1[] = "\xf2\x0f\x10\x48\x00";
+    uint64_t literal;
+    load_xmm0[4] = offsetof(struct Object, number);
+    load_xmm1[4] = offsetof(struct Object, number);
+    if (instruction->value)
+    {
+        /* mov rax, [rbx - 8]; movsd xmm0, [rax + number] */
+        emit_bytes(vm, "\x48\x8b\x43\xf8", 4);
+        emit_bytes(vm, load_xmm0, 5);
+        /* movabs rax, literal; movq xmm1, rax */
+        memcpy(&literal, &instruction->value->number, sizeof(literal));
+        emit_load_rax(vm, literal);
+        emit_bytes(vm, "\x66\x48\x0f\x6e\xc8", 5);
+    }
+    else
+    {
+        /* mov rax, [rbx - 16]; movsd xmm0, [rax + number] */
+        emit_bytes(vm, "\x48\x8b\x43\xf0", 4);
+        emit_bytes(vm, load_xmm0, 5);
+        /* mov rax, [rbx - 8]; movsd xmm1, [rax + number] */
+        emit_bytes(vm, "\x48\x8b\x43\xf8", 4);
+        emit_bytes(vm, load_xmm1, 5);
+    }
+}
+
+/*
+ * "operation" is the second byte of the SSE2 instruction computing
+ * xmm0 = xmm0 <op> xmm1, e.g. 0x58 for addsd.
+ */
+void emit_arithmetic_template(struct VM *vm, struct Instruction *instruction, char operation)
+{
+    char bytes[] = "\xf2\x0f\x00\xc1";
+    emit_load_operands(vm, instruction);
+    bytes[2] = operation;
+    emit_bytes(vm, bytes, 4);
+    emit_call(vm, (uintptr_t)new_number);
+    emit_replace_operands(vm, instruction->value ? 1 : 2);
+}
+
+void emit_mod_template(struct VM *vm, struct Instruction *instruction)
+{
+    emit_load_operands(vm, instruction);
+    emit_call(vm, (uintptr_t)fmod);
+    emit_call(vm, (uintptr_t)new_number);
+    emit_replace_operands(vm, instruction->value ? 1 : 2);
+}
+
+void emit_cons_template(struct VM *vm)
+{
+    /* mov rsi, [rbx - 16]; mov rdx, [rbx - 8] */
+    emit_bytes(vm, "\x48\x8b\x73\xf0\x48\x8b\x53\xf8", 8);
+    emit_call(vm, (uintptr_t)cons_pair);
+    emit_replace_operands(vm, 2);
+}
+
+void emit_reload_stack(struct VM *vm)
+{
+    /* movabs rax, &stack; mov r12, [rax] */
+    emit_load_rax(vm, (uintptr_t)&vm->stack);
+    emit_bytes(vm, "\x4c\x8b\x20", 3);
+    /* movabs rax, &stack_size; movsxd r14, [rax]; lea r14, [r12 + r14 * 8] */
+    emit_load_rax(vm, (uintptr_t)&vm->stack_size);
+    emit_bytes(vm, "\x4c\x63\x30\x4f\x8d\x34\xf4", 7);
+    /* movsxd rax, [r13]; lea rbx, [r12 + rax * 8] */
+    emit_bytes(vm, "\x49\x63\x45\x00\x49\x8d\x1c\xc4", 8);
+}
+
+/*
+ * Grows the stack if it is full, like push() does.
+ */
+void emit_stack_check(struct VM *vm)
+{
+    int jump;
+    /* cmp rbx, r14; jb over the call */
+    emit_bytes(vm, "\x4c\x39\xf3\x72\x00", 5);
+    jump = vm->jit_length;
+    emit_call(vm, (uintptr_t)grow_stack);
+    emit_reload_stack(vm);
+    vm->jit_buffer[jump - 1] = vm->jit_length - jump;
+}
+
+/*
+ * Parks the thread if a collection has been requested, like poll_safepoint()
+ * does before every instruction of the interpreter.
+ */
+void emit_safepoint_poll(struct VM *vm)
+{
+    int jump;
+    /* movabs rax, &safepoint_requested; cmp dword [rax], 0; je over the call */
+    emit_load_rax(vm, (uintptr_t)&vm->heap->safepoint_requested);
+    emit_bytes(vm, "\x83\x38\x00\x74\x00", 5);
+    jump = vm->jit_length;
+    emit_call(vm, (uintptr_t)safepoint);
+    vm->jit_buffer[jump - 1] = vm->jit_length - jump;
+}
+
+void emit_push_null_template(struct VM *vm)
+{
+    emit_stack_check(vm);
+    /* mov qword [rbx], 0; add rbx, 8 */
+    emit_bytes(vm, "\x48\xc7\x03\x00\x00\x00\x00\x48\x83\xc3\x08", 11);
+}
+
+/*
+ * Instructions without a template of their own are executed by calling back
+ * into C. The callee may push, pop and grow the stack, so we reload the stack
+ * afterwards.
+ */
+void emit_call_back(struct VM *vm, struct Instruction *instruction)
+{
+    /* movabs rsi, instruction */
+    emit_bytes(vm, "\x48\xbe", 2);
+    emit_quad(vm, (uintptr_t)instruction);
+    emit_call(vm, (uintptr_t)execute_collection);
+    emit_reload_stack(vm);
+}
+
+void print_top(struct VM *vm)
+{
+    print_object(vm, peek(vm));
+    output_char(vm, '\n');
+}
+
+void emit_template(struct VM *vm, struct Instruction *instruction)
+{
+    switch (instruction->opcode)
+    {
+        case ADD_OP:
+        case ADD_NUMBER_OP:
+            emit_arithmetic_template(vm, instruction, 0x58);
+            break;
+        case CONS_OP:
+            emit_cons_template(vm);
+            break;
+        case DIV_OP:
+        case DIV_NUMBER_OP:
+            emit_arithmetic_template(vm, instruction, 0x5e);
+            break;
+        case END_OP:
+            /* write back stack_length; pop r15; pop r14; pop r13; pop r12; pop rbx; ret */
+            emit_bytes(vm, "\x48\x89\xd9\x4c\x29\xe1\x48\xc1\xf9\x03\x41\x89\x4d\x00", 14);
+            emit_bytes(vm, "\x41\x5f\x41\x5e\x41\x5d\x41\x5c\x5b\xc3", 10);
+            break;
+        case MOD_OP:
+        case MOD_NUMBER_OP:
+            emit_mod_template(vm, instruction);
+            break;
+        case MUL_OP:
+        case MUL_NUMBER_OP:
+            emit_arithmetic_template(vm, instruction, 0x59);
+            break;
+        case NULL_OP:
+            emit_push_null_template(vm);
+            break;
+        case NUMBER_OP:
+        case STRING_OP:
+            emit_stack_check(vm);
+            /* mov [rbx], rax; add rbx, 8 */
+            emit_load_rax(vm, (uintptr_t)instruction->value);
+            emit_bytes(vm, "\x48\x89\x03\x48\x83\xc3\x08", 7);
+            break;
+        case POP_OP:
+            /* sub rbx, 8 */
+            emit_bytes(vm, "\x48\x83\xeb\x08", 4);
+            break;
+        case PRINT_OP:
+            emit_call(vm, (uintptr_t)print_top);
+            break;
+        case PRINT_POP_OP:
+            emit_call(vm, (uintptr_t)print_top);
+            emit_bytes(vm, "\x48\x83\xeb\x08", 4);
+            break;
+        case SUB_OP:
+        case SUB_NUMBER_OP:
+            emit_arithmetic_template(vm, instruction, 0x5c);
+            break;
+        case APPEND_OP:
+        case ARRAY_OP:
+        case ARRAY_NUMBER_OP:
+        case GET_OP:
+        case GET_NUMBER_OP:
+        case LENGTH_OP:
+        case LIST_OP:
+        case MAP_OP:
+        case SET_OP:
+        case VADD_OP:
+        case VDIV_OP:
+        case VDOT_OP:
+        case VECTOR_OP:
+        case VMUL_OP:
+        case VSUB_OP:
+        case VSUM_OP:
+            emit_call_back(vm, instruction);
+            break;
+    }
+}
+
+/*
+ * Translates the program into machine code. If the executable memory cannot be
+ * mapped, jit_code stays NULL and run() uses the interpreter.
+ */
+void jit_compile(struct VM *vm)
+{
+    int i;
+    int *offsets = calloc(vm->program_length + 1, sizeof(int));
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t size;
+    void *memory;
+    char perf_map_name[JIT_PERF_MAP_SIZE];
+    FILE *perf_map;
+    vm->jit_length = 0;
+    /* push rbx; push r12; push r13; push r14; push r15; movabs r15, vm */
+    emit_bytes(vm, "\x53\x41\x54\x41\x55\x41\x56\x41\x57\x49\xbf", 11);
+    emit_quad(vm, (uintptr_t)vm);
+    /* movabs r13, &stack_length */
+    emit_bytes(vm, "\x49\xbd", 2);
+    emit_quad(vm, (uintptr_t)&vm->stack_length);
+    emit_reload_stack(vm);
+    for (i = 0; i < vm->program_length; i++)
+    {
+        offsets[i] = vm->jit_length;
+        emit_safepoint_poll(vm);
+        emit_template(vm, &vm->program[i]);
+    }
+    offsets[vm->program_length] = vm->jit_length;
+    size = (vm->jit_length + page_size - 1) / page_size * page_size;
+    memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory != MAP_FAILED)
+    {
+        memcpy(memory, vm->jit_buffer, vm->jit_length);
+        if (mprotect(memory, size, PROT_READ | PROT_EXEC) == 0)
+        {
+            vm->jit_code = (void (*)(void))memory;
+            vm->jit_code_size = size;
+            snprintf(perf_map_name, JIT_PERF_MAP_SIZE, "/tmp/perf-%d.map", (int)getpid());
+            perf_map = fopen(perf_map_name, "a");
+            if (perf_map)
+            {
+                fprintf(perf_map, "%lx %x jit_prologue\n", (unsigned long)memory, offsets[0]);
+                for (i = 0; i < vm->program_length; i++)
+                {
+                    fprintf(perf_map, "%lx %x jit_%s_%d\n", (unsigned long)memory + offsets[i], offsets[i + 1] - offsets[i], opcode_names[vm->program[i].opcode], i);
+                }
+                fclose(perf_map);
+            }
         }
+        else
+        {
+            munmap(memory, size);
+        }
+    }
+    free(offsets);
+}
+#endif
+
+/*
+ * Runs the compiled program, using the machine code if there is any.
+ */
+void run(struct VM *vm)
+{
+#ifdef JIT
+    if (vm->jit_code)
+    {
+        vm->jit_code();
+        return;
     }
+#endif
+    interpret(vm);
 }
 
 /*
- * And we are done. Let's start the interpreter and then our garbage collector.
+ * And we are done. Let's compile the script, start the interpreter and then our
+ * garbage collector. Programs embedding the virtual machine bring their own
+ * main function.
  */
+#ifndef GC_NO_MAIN
 int main(void)
 {
-    interpret();
-    putchar('\n');
-    stop_the_world_mark_and_sweep();
+    struct VM *vm = new_vm(NULL, code);
+    int strings;
+    size_t bytes;
+    compile(vm);
+#ifdef JIT
+    if (getenv("GC_JIT"))
+    {
+        jit_compile(vm);
+    }
+#endif
+    if (getenv("GC_DEDUPLICATE"))
+    {
+        set_string_deduplication(vm->heap, 1);
+    }
+    if (getenv("GC_HASH_CONS"))
+    {
+        set_hash_consing(vm->heap, 1);
+    }
+    if (getenv("GC_HUGE_PAGES"))
+    {
+        set_huge_pages(vm->heap, 1);
+    }
+    run(vm);
+    output_char(vm, '\n');
+    stop_the_world_mark_and_sweep(vm);
+    if (getenv("GC_DEDUPLICATE"))
+    {
+        get_deduplication_statistics(vm->heap, &strings, &bytes);
+        fprintf(stderr, "Deduplicated %d strings, saving %zu bytes\n", strings, bytes);
+    }
+    delete_vm(vm);
     return 0;
 }
+#endif
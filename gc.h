@@ -0,0 +1,180 @@
+/*
+ * The interface for programs embedding the garbage collector. Build gc.c with
+ * -DGC_NO_MAIN and link it with your own code:
+ *
+ * gcc -c gc.c -O2 -DGC_NO_MAIN -pthread && g++ host.cpp gc.o -pthread -lm
+ *
+ * The collector only finds objects reachable from the stack of a virtual
+ * machine. A host holding objects in its own variables must tell it about them
+ * through handles, or the next collection deletes them. Handles are slots in a
+ * handle area the collector scans, and they are released together when the
+ * handle scope they were created in is closed:
+ *
+ * struct HandleScope scope;
+ * struct Object **array;
+ * open_handle_scope(vm, &scope);
+ * array = new_handle(vm, new_array(vm));
+ * append_element(vm, *array, new_number(vm, 1));
+ * ...
+ * close_handle_scope(&scope);
+ *
+ * Scopes must be closed in the reverse order they were opened.
+ */
+#ifndef GC_H
+#define GC_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+struct HandleBlock;
+struct Heap;
+struct Object;
+struct VM;
+
+struct HandleScope
+{
+    struct VM *vm;
+    struct HandleBlock *block;
+    struct Object **top;
+};
+
+struct Heap *new_heap(void);
+void delete_heap(struct Heap *heap);
+struct VM *new_vm(struct Heap *heap, char *code);
+void delete_vm(struct VM *vm);
+void compile(struct VM *vm);
+void run(struct VM *vm);
+void stop_the_world_mark_and_sweep(struct VM *vm);
+void enter_safe_region(struct VM *vm);
+void leave_safe_region(struct VM *vm);
+void get_safepoint_statistics(struct Heap *heap, int *count, double *total, double *maximum);
+void set_string_deduplication(struct Heap *heap, int enabled);
+void set_hash_consing(struct Heap *heap, int enabled);
+void set_huge_pages(struct Heap *heap, int enabled);
+void get_deduplication_statistics(struct Heap *heap, int *strings, size_t *bytes);
+void register_finalizer(struct VM *vm, struct Object *object, void (*function)(struct VM *vm, struct Object *object, void *data), void *data);
+
+struct Object *new_array(struct VM *vm);
+struct Object *new_number(struct VM *vm, double number);
+struct Object *new_pair(struct VM *vm, struct Object *head, struct Object *tail);
+struct Object *new_list(struct VM *vm, struct Object **heads, int length, struct Object *tail);
+struct Object *hash_cons_pair(struct VM *vm, struct Object *head, struct Object *tail);
+struct Object *new_string(struct VM *vm, char *string);
+struct Object *intern_string(struct VM *vm, char *string);
+struct Object *new_weak_ref(struct VM *vm, struct Object *target);
+struct Object *new_ephemeron_table(struct VM *vm);
+struct Object *new_map(struct VM *vm);
+void append_element(struct VM *vm, struct Object *array, struct Object *element);
+void append_elements(struct VM *vm, struct Object *array, struct Object *other);
+void reserve_elements(struct VM *vm, struct Object *array, int size);
+struct Object *remove_element(struct VM *vm, struct Object *array, int index);
+struct Object *pop_element(struct VM *vm, struct Object *array);
+void truncate_array(struct VM *vm, struct Object *array, int length);
+struct Object *slice_array(struct VM *vm, struct Object *array, int start, int end);
+struct Object *concat_arrays(struct VM *vm, struct Object *first, struct Object *second);
+struct Object *get_element(struct Object *array, int index);
+void set_element(struct Object *array, int index, struct Object *element);
+struct Object *weak_ref_target(struct Object *weak_ref);
+struct Object *get_ephemeron(struct Object *table, struct Object *key);
+void set_ephemeron(struct Object *table, struct Object *key, struct Object *value);
+struct Object *get_from_map(struct Object *map, struct Object *key);
+void set_in_map(struct Object *map, struct Object *key, struct Object *value);
+struct Object *remove_from_map(struct Object *map, struct Object *key);
+void print_object(struct VM *vm, struct Object *object);
+void flush_output(struct VM *vm);
+
+void open_handle_scope(struct VM *vm, struct HandleScope *scope);
+void close_handle_scope(struct HandleScope *scope);
+struct Object **new_handle(struct VM *vm, struct Object *object);
+
+#ifdef __cplusplus
+}
+
+/*
+ * In C++ scopes close themselves at the end of a block, and handles look like
+ * the pointers they hold:
+ *
+ * gc::HandleScope scope(vm);
+ * gc::Local array(vm, new_array(vm));
+ * append_element(vm, array, new_number(vm, 1));
+ *
+ * A handle stays valid until its scope is destroyed; copying one copies the
+ * slot, not the object, so copies see every update of the original.
+ */
+namespace gc
+{
+    class HandleScope
+    {
+    public:
+        explicit HandleScope(VM *vm)
+        {
+            open_handle_scope(vm, &scope);
+        }
+
+        ~HandleScope()
+        {
+            close_handle_scope(&scope);
+        }
+
+        HandleScope(const HandleScope &) = delete;
+        HandleScope &operator=(const HandleScope &) = delete;
+
+    private:
+        ::HandleScope scope;
+    };
+
+    template <typename T = Object>
+    class Handle
+    {
+    public:
+        Handle() : slot(nullptr)
+        {
+        }
+
+        Handle(VM *vm, T *object) : slot(new_handle(vm, object))
+        {
+        }
+
+        T *get() const
+        {
+            return slot ? *slot : nullptr;
+        }
+
+        void set(T *object)
+        {
+            *slot = object;
+        }
+
+        bool is_empty() const
+        {
+            return !get();
+        }
+
+        T &operator*() const
+        {
+            return **slot;
+        }
+
+        T *operator->() const
+        {
+            return *slot;
+        }
+
+        operator T *() const
+        {
+            return get();
+        }
+
+    private:
+        T **slot;
+    };
+
+    typedef Handle<Object> Local;
+}
+#endif
+
+#endif
@@ -0,0 +1,71 @@
+/*
+ * Compiles a script with a number and a string literal, checks that running
+ * it allocates nothing, and that writing to either literal afterwards crashes
+ * instead of silently changing the program. Build and run from this
+ * directory:
+ *
+ * gcc -DGC_NO_MAIN constants.c -pthread -lm && ./a.out
+ */
+#include <sys/wait.h>
+#include "../gc.c"
+
+/*
+ * The child exits normally only if the write went through. Under a sanitizer
+ * the fault ends it with an error status rather than SIGSEGV.
+ */
+int crashes_writing(struct Object *constant)
+{
+    int status;
+    pid_t child = fork();
+    if (child == 0)
+    {
+        if (constant->type == NUMBER)
+        {
+            constant->number = 0;
+        }
+        else
+        {
+            constant->characters[0] = '?';
+        }
+        _exit(0);
+    }
+    waitpid(child, &status, 0);
+    return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+int main(void)
+{
+    struct VM *vm = new_vm(NULL, "1.5 print pop \"text\" print pop");
+    int passed = 1;
+    int i;
+    compile(vm);
+    if (vm->program[0].opcode != NUMBER_OP || vm->program[2].opcode != STRING_OP)
+    {
+        printf("FAIL: unexpected program\n");
+        delete_vm(vm);
+        return 1;
+    }
+    for (i = 0; i < 2; i++)
+    {
+        run(vm);
+        vm->output_length = 0;
+        vm->stack_length = 0;
+    }
+    if (vm->list_of_objects)
+    {
+        printf("FAIL: running the program allocated objects\n");
+        passed = 0;
+    }
+    if (!crashes_writing(vm->program[0].value) || !crashes_writing(vm->program[2].value))
+    {
+        printf("FAIL: a literal could be written after compiling\n");
+        passed = 0;
+    }
+    delete_vm(vm);
+    if (!passed)
+    {
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,70 @@
+/*
+ * Fills an array with strings of a few distinct contents and checks that,
+ * with string deduplication on, the collection after they reach
+ * DEDUPLICATION_AGE counts every duplicate and its bytes exactly once and
+ * leaves the array referencing one string per content. Build and run from
+ * this directory:
+ *
+ * gcc -DGC_NO_MAIN dedup.c -pthread -lm && ./a.out >/dev/null
+ *
+ * The collector reports every object it looks at on standard output, so the
+ * result goes to standard error.
+ */
+#include "../gc.c"
+
+#define CONTENTS 10
+#define COPIES 10
+
+int main(void)
+{
+    struct Heap *heap = new_heap();
+    struct VM *vm = new_vm(heap, "");
+    struct HandleScope scope;
+    struct Object **array;
+    char characters[16];
+    size_t expected_bytes = 0;
+    size_t bytes;
+    int strings;
+    int passed = 1;
+    int i;
+    set_string_deduplication(heap, 1);
+    open_handle_scope(vm, &scope);
+    array = new_handle(vm, new_array(vm));
+    for (i = 0; i < CONTENTS * COPIES; i++)
+    {
+        snprintf(characters, sizeof(characters), "string %d", i % CONTENTS);
+        append_element(vm, *array, new_string(vm, characters));
+        if (i >= CONTENTS)
+        {
+            expected_bytes += object_size((*array)->array[i]);
+        }
+    }
+    for (i = 1; i <= DEDUPLICATION_AGE + 2; i++)
+    {
+        stop_the_world_mark_and_sweep(vm);
+        get_deduplication_statistics(heap, &strings, &bytes);
+        if (i == DEDUPLICATION_AGE + 1 ? (strings != CONTENTS * (COPIES - 1) || bytes != expected_bytes) : (strings != 0 || bytes != 0))
+        {
+            fprintf(stderr, "FAIL: collection %d found %d duplicates taking %zu bytes\n", i, strings, bytes);
+            passed = 0;
+        }
+    }
+    for (i = 0; i < CONTENTS * COPIES; i++)
+    {
+        if ((*array)->array[i] != (*array)->array[i % CONTENTS])
+        {
+            fprintf(stderr, "FAIL: element %d was not replaced by its first copy\n", i);
+            passed = 0;
+            break;
+        }
+    }
+    close_handle_scope(&scope);
+    delete_vm(vm);
+    delete_heap(heap);
+    if (!passed)
+    {
+        return 1;
+    }
+    fprintf(stderr, "PASS\n");
+    return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * Registers a finalizer on an unreachable object and checks that it runs
+ * exactly once, for that object, on the finalizer thread rather than the
+ * collecting one. Build and run from this directory:
+ *
+ * gcc -I.. -DGC_NO_MAIN ../gc.c finalizer.c -pthread -lm && ./a.out >/dev/null
+ *
+ * The collector reports every object it looks at on standard output, so the
+ * result goes to standard error.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "gc.h"
+
+#define COLLECTIONS 3
+
+atomic_int calls;
+pthread_t finalizer_thread;
+struct Object *finalized;
+
+void finalize(struct VM *vm, struct Object *object, void *data)
+{
+    (void)vm;
+    (void)data;
+    finalizer_thread = pthread_self();
+    finalized = object;
+    atomic_fetch_add(&calls, 1);
+}
+
+int main(void)
+{
+    struct Heap *heap = new_heap();
+    struct VM *vm = new_vm(heap, "");
+    struct Object *object = new_string(vm, "resource");
+    int passed = 1;
+    int i;
+    alarm(5);
+    register_finalizer(vm, object, finalize, NULL);
+    for (i = 0; i < COLLECTIONS; i++)
+    {
+        stop_the_world_mark_and_sweep(vm);
+        while (atomic_load(&calls) == 0)
+        {
+            usleep(1000);
+        }
+    }
+    usleep(100000);
+    if (atomic_load(&calls) != 1)
+    {
+        fprintf(stderr, "FAIL: the finalizer ran %d times\n", atomic_load(&calls));
+        passed = 0;
+    }
+    if (finalized != object)
+    {
+        fprintf(stderr, "FAIL: the finalizer got another object\n");
+        passed = 0;
+    }
+    if (pthread_equal(finalizer_thread, pthread_self()))
+    {
+        fprintf(stderr, "FAIL: the finalizer ran on the collecting thread\n");
+        passed = 0;
+    }
+    delete_vm(vm);
+    delete_heap(heap);
+    if (!passed)
+    {
+        return 1;
+    }
+    fprintf(stderr, "PASS\n");
+    return 0;
+}
@@ -0,0 +1,64 @@
+/*
+ * Checks that hash-consing pairs with equal heads and tails gives the same
+ * pair, so equal lists are the same object, and that the table of
+ * hash-consed pairs holds them weakly: once the last reference is gone, a
+ * collection drops them from it. Build and run from this directory:
+ *
+ * gcc -DGC_NO_MAIN hash_cons.c -pthread -lm && ./a.out >/dev/null
+ *
+ * The collector reports every object it looks at on standard output, so the
+ * result goes to standard error.
+ */
+#include "../gc.c"
+
+int main(void)
+{
+    struct Heap *heap = new_heap();
+    struct VM *vm = new_vm(heap, "");
+    struct HandleScope scope;
+    struct Object **kept;
+    struct Object *list;
+    int count;
+    int passed = 1;
+    open_handle_scope(vm, &scope);
+    kept = new_handle(vm, hash_cons_pair(vm, new_number(vm, 1), hash_cons_pair(vm, new_string(vm, "two"), NULL)));
+    list = hash_cons_pair(vm, new_number(vm, 1), hash_cons_pair(vm, new_string(vm, "two"), NULL));
+    if (list != *kept || hash_cons_pair(vm, new_number(vm, 1), NULL) == hash_cons_pair(vm, new_number(vm, 2), NULL))
+    {
+        fprintf(stderr, "FAIL: hash-consed pairs are not unique\n");
+        passed = 0;
+    }
+    if (hash_cons_pair(vm, new_number(vm, 0), NULL) == hash_cons_pair(vm, new_number(vm, -0.0), NULL))
+    {
+        fprintf(stderr, "FAIL: 0 and -0 share a hash-consed pair\n");
+        passed = 0;
+    }
+    count = heap->hash_consed_pairs.count;
+    stop_the_world_mark_and_sweep(vm);
+    if (heap->hash_consed_pairs.count != 2)
+    {
+        fprintf(stderr, "FAIL: %d of %d hash-consed pairs left, expected 2\n", heap->hash_consed_pairs.count, count);
+        passed = 0;
+    }
+    if (hash_cons_pair(vm, new_string(vm, "two"), NULL) != (*kept)->tail)
+    {
+        fprintf(stderr, "FAIL: a reachable hash-consed pair was dropped\n");
+        passed = 0;
+    }
+    *kept = NULL;
+    stop_the_world_mark_and_sweep(vm);
+    if (heap->hash_consed_pairs.count != 0)
+    {
+        fprintf(stderr, "FAIL: unreachable hash-consed pairs were kept\n");
+        passed = 0;
+    }
+    close_handle_scope(&scope);
+    delete_vm(vm);
+    delete_heap(heap);
+    if (!passed)
+    {
+        return 1;
+    }
+    fprintf(stderr, "PASS\n");
+    return 0;
+}
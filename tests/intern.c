@@ -0,0 +1,58 @@
+/*
+ * Checks that interning the same characters twice gives the same string, one
+ * that new_string never returns, and that the table of interned strings holds
+ * them weakly: once the last reference is gone, a collection drops them from
+ * it. Build and run from this directory:
+ *
+ * gcc -DGC_NO_MAIN intern.c -pthread -lm && ./a.out >/dev/null
+ *
+ * The collector reports every object it looks at on standard output, so the
+ * result goes to standard error.
+ */
+#include "../gc.c"
+
+int main(void)
+{
+    struct Heap *heap = new_heap();
+    struct VM *vm = new_vm(heap, "");
+    struct HandleScope scope;
+    struct Object **kept;
+    int count;
+    int passed = 1;
+    open_handle_scope(vm, &scope);
+    kept = new_handle(vm, intern_string(vm, "kept"));
+    intern_string(vm, "dropped");
+    if (intern_string(vm, "kept") != *kept || new_string(vm, "kept") == *kept)
+    {
+        fprintf(stderr, "FAIL: interned strings are not unique\n");
+        passed = 0;
+    }
+    count = heap->interned_strings.count;
+    stop_the_world_mark_and_sweep(vm);
+    if (heap->interned_strings.count != count - 1)
+    {
+        fprintf(stderr, "FAIL: %d of %d interned strings left, expected %d\n", heap->interned_strings.count, count, count - 1);
+        passed = 0;
+    }
+    if (intern_string(vm, "kept") != *kept)
+    {
+        fprintf(stderr, "FAIL: a reachable interned string was dropped\n");
+        passed = 0;
+    }
+    *kept = NULL;
+    stop_the_world_mark_and_sweep(vm);
+    if (heap->interned_strings.count != count - 2)
+    {
+        fprintf(stderr, "FAIL: an unreachable interned string was kept\n");
+        passed = 0;
+    }
+    close_handle_scope(&scope);
+    delete_vm(vm);
+    delete_heap(heap);
+    if (!passed)
+    {
+        return 1;
+    }
+    fprintf(stderr, "PASS\n");
+    return 0;
+}
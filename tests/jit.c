@@ -0,0 +1,81 @@
+/*
+ * Runs scripts covering every template of the JIT and the instructions it
+ * calls back into C for, once with the interpreter and once with the JIT, and
+ * checks that both print the same. Build and run from this directory:
+ *
+ * gcc -DGC_NO_MAIN jit.c -pthread -lm && ./a.out
+ */
+#include "../gc.c"
+
+#define DEEP_STACK 1000
+
+char *scripts[] =
+{
+    "1 2 add 3 mul print pop 1 2 3 null cons cons cons print",
+    "1 array 1.5 append 0 get 1 array 4 append 0 get add print 3 sub print 2 mul print 4 div print 0.5 mod print",
+    "1 array 7 append 0 get 2 mod print pop 1 null cons 2 cons print",
+    "1 2 3 3 vector 4 5 6 3 vector vadd 1 1 1 3 vector vmul 2 2 2 3 vector vdiv 1 1 1 3 vector vsub print vsum print",
+    "1 2 2 vector 3 4 2 vector vdot print",
+    "map \"a\" 1 set \"b\" 2.5 set \"a\" get print pop map 1 \"one\" set 1 get print",
+    "\"hello\" print length print 2 array null append 3 append length print",
+    "4 array 1 append 2 append 0 99 set 1 get print"
+};
+
+int run_script(char *code, int use_jit, char *output)
+{
+    struct VM *vm = new_vm(NULL, code);
+    int length;
+    compile(vm);
+    if (use_jit)
+    {
+        jit_compile(vm);
+        if (!vm->jit_code)
+        {
+            delete_vm(vm);
+            return -1;
+        }
+    }
+    run(vm);
+    length = vm->output_length;
+    memcpy(output, vm->output_buffer, length);
+    vm->output_length = 0;
+    delete_vm(vm);
+    return length;
+}
+
+int check(char *code)
+{
+    static char interpreted[OUTPUT_BUFFER_SIZE];
+    static char compiled[OUTPUT_BUFFER_SIZE];
+    int interpreted_length = run_script(code, 0, interpreted);
+    int compiled_length = run_script(code, 1, compiled);
+    if (interpreted_length != compiled_length || memcmp(interpreted, compiled, interpreted_length) != 0)
+    {
+        printf("FAIL: %s\ninterpreter: %.*s\nJIT: %.*s\n", code, interpreted_length, interpreted, compiled_length < 0 ? 0 : compiled_length, compiled);
+        return 0;
+    }
+    return 1;
+}
+
+int main(void)
+{
+    char deep[6 * DEEP_STACK + 16] = "";
+    int passed = 1;
+    int i;
+    for (i = 0; i < (int)(sizeof(scripts) / sizeof(scripts[0])); i++)
+    {
+        passed &= check(scripts[i]);
+    }
+    for (i = 0; i < DEEP_STACK; i++)
+    {
+        strcat(deep, "2.5 ");
+    }
+    strcat(deep, "print");
+    passed &= check(deep);
+    if (!passed)
+    {
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,84 @@
+/*
+ * Sets, gets and removes map entries through several resizes and many deleted
+ * slots, and checks that every key is found exactly when it should be, that
+ * deleted slots don't make the map grow forever, and that strings, NaN and -0
+ * are found as equal keys. Build and run from this directory:
+ *
+ * gcc -DGC_NO_MAIN map.c -pthread -lm && ./a.out
+ */
+#include "../gc.c"
+
+#define KEYS 1000
+#define CHURN 10000
+
+int check_keys(struct VM *vm, struct Object *map, int removed)
+{
+    struct Object *value;
+    int i;
+    for (i = 0; i < KEYS; i++)
+    {
+        value = get_from_map(map, new_number(vm, i + 0.5));
+        if ((removed && i % 2 == 0) ? value != NULL : (!value || value->number != i))
+        {
+            printf("FAIL: key %g\n", i + 0.5);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(void)
+{
+    struct VM *vm = new_vm(NULL, "");
+    struct HandleScope scope;
+    struct Object **map;
+    struct Object *value;
+    int passed = 1;
+    int size;
+    int i;
+    open_handle_scope(vm, &scope);
+    map = new_handle(vm, new_map(vm));
+    for (i = 0; i < KEYS; i++)
+    {
+        set_in_map(*map, new_number(vm, i + 0.5), new_number(vm, i));
+    }
+    passed &= check_keys(vm, *map, 0);
+    for (i = 0; i < KEYS; i += 2)
+    {
+        value = remove_from_map(*map, new_number(vm, i + 0.5));
+        passed &= value && value->number == i;
+    }
+    passed &= remove_from_map(*map, new_number(vm, 0.5)) == NULL;
+    passed &= check_keys(vm, *map, 1) && (*map)->length == KEYS / 2;
+    size = (*map)->size;
+    for (i = 0; i < CHURN; i++)
+    {
+        set_in_map(*map, new_number(vm, -i - 0.5), NULL);
+        remove_from_map(*map, new_number(vm, -i - 0.5));
+    }
+    if ((*map)->size > size || (*map)->length != KEYS / 2)
+    {
+        printf("FAIL: map grew from %d to %d slots with deleted entries\n", size, (*map)->size);
+        passed = 0;
+    }
+    passed &= check_keys(vm, *map, 1);
+    set_in_map(*map, new_string(vm, "alpha"), new_number(vm, 1));
+    passed &= get_from_map(*map, new_string(vm, "alpha")) == new_number(vm, 1);
+    set_in_map(*map, new_number(vm, NAN), new_number(vm, 2));
+    set_in_map(*map, new_number(vm, NAN), new_number(vm, 3));
+    passed &= get_from_map(*map, new_number(vm, NAN)) == new_number(vm, 3);
+    passed &= remove_from_map(*map, new_number(vm, NAN)) == new_number(vm, 3);
+    passed &= get_from_map(*map, new_number(vm, NAN)) == NULL;
+    set_in_map(*map, new_number(vm, 0), new_number(vm, 4));
+    passed &= get_from_map(*map, new_number(vm, -0.0)) == new_number(vm, 4);
+    passed &= (*map)->length == KEYS / 2 + 2;
+    close_handle_scope(&scope);
+    delete_vm(vm);
+    if (!passed)
+    {
+        printf("FAIL\n");
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,105 @@
+/*
+ * Compiles a few scripts and checks that the peephole optimizations rewrote
+ * them into the expected instructions, and that the rewritten programs still
+ * print what the scripts say. Build and run from this directory:
+ *
+ * gcc -DGC_NO_MAIN peephole.c -pthread -lm && ./a.out
+ */
+#include "../gc.c"
+
+#define MAXIMUM_INSTRUCTIONS 8
+
+struct Case
+{
+    char *code;
+    enum Opcode opcodes[MAXIMUM_INSTRUCTIONS];
+    int count;
+    double value;
+    char *output;
+};
+
+/*
+ * "count" is checked on LIST_OP and ARRAY_NUMBER_OP, "value" on ADD_NUMBER_OP
+ * and on a leading NUMBER_OP, where it is the result of folding, if not 0.
+ */
+struct Case cases[] =
+{
+    {"1 2 add 3 mul print pop", {NUMBER_OP, PRINT_POP_OP, END_OP}, 0, 9, "9\n"},
+    {"7 2 sub 2 div 4 mod print", {NUMBER_OP, PRINT_OP, END_OP}, 0, 2.5, "2.5\n"},
+    {"1 2 3 null cons cons cons print", {NUMBER_OP, NUMBER_OP, NUMBER_OP, LIST_OP, PRINT_OP, END_OP}, 3, 0, "(1 2 3)\n"},
+    {"4 array length 3 add print", {ARRAY_NUMBER_OP, LENGTH_OP, ADD_NUMBER_OP, PRINT_OP, END_OP}, 4, 3, "3\n"},
+    {"\"text\" pop 1.5 pop null pop 5 print", {NUMBER_OP, PRINT_OP, END_OP}, 0, 5, "5\n"},
+    {"1 null cons 2 cons print", {NUMBER_OP, LIST_OP, NUMBER_OP, CONS_OP, PRINT_OP, END_OP}, 1, 0, "((1) . 2)\n"}
+};
+
+int check(struct Heap *heap, struct Case *test)
+{
+    struct VM *vm = new_vm(heap, test->code);
+    struct Instruction *instruction;
+    int passed = 1;
+    int i;
+    compile(vm);
+    for (i = 0; test->opcodes[i] != END_OP; i++)
+    {
+        if (i >= vm->program_length || vm->program[i].opcode != test->opcodes[i])
+        {
+            passed = 0;
+        }
+    }
+    if (vm->program_length != i + 1 || vm->program[i].opcode != END_OP)
+    {
+        passed = 0;
+    }
+    for (i = 0; passed && i < vm->program_length; i++)
+    {
+        instruction = &vm->program[i];
+        switch (instruction->opcode)
+        {
+            case LIST_OP:
+            case ARRAY_NUMBER_OP:
+                passed = instruction->count == test->count;
+                break;
+            case ADD_NUMBER_OP:
+                passed = instruction->value->number == test->value;
+                break;
+            case NUMBER_OP:
+                if (test->value && i == 0)
+                {
+                    passed = instruction->value->number == test->value;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    run(vm);
+    if (vm->output_length != (int)strlen(test->output) || memcmp(vm->output_buffer, test->output, vm->output_length) != 0)
+    {
+        passed = 0;
+    }
+    vm->output_length = 0;
+    delete_vm(vm);
+    if (!passed)
+    {
+        printf("FAIL: %s\n", test->code);
+    }
+    return passed;
+}
+
+int main(void)
+{
+    struct Heap *heap = new_heap();
+    int passed = 1;
+    int i;
+    for (i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); i++)
+    {
+        passed &= check(heap, &cases[i]);
+    }
+    delete_heap(heap);
+    if (!passed)
+    {
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * Prints an array that contains itself along with enough other arrays to make
+ * the table of print_object() grow while it looks for shared objects. The
+ * array must still be labelled, or printing it never ends. Build and run from
+ * this directory:
+ *
+ * gcc -I.. -DGC_NO_MAIN ../gc.c print_cycle.c -pthread -lm && ./a.out
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "gc.h"
+
+#define EMPTY_ARRAYS 20
+
+int main(void)
+{
+    struct Heap *heap = new_heap();
+    struct VM *vm = new_vm(heap, "");
+    struct HandleScope scope;
+    struct Object **array;
+    char expected[256] = "#1=[#1#";
+    char output[256] = "";
+    FILE *file = tmpfile();
+    int saved_stdout;
+    int i;
+    size_t length;
+    open_handle_scope(vm, &scope);
+    array = new_handle(vm, new_array(vm));
+    append_element(vm, *array, *array);
+    for (i = 0; i < EMPTY_ARRAYS; i++)
+    {
+        append_element(vm, *array, new_array(vm));
+        strcat(expected, ", []");
+    }
+    strcat(expected, "]");
+    alarm(5);
+    fflush(stdout);
+    saved_stdout = dup(STDOUT_FILENO);
+    dup2(fileno(file), STDOUT_FILENO);
+    print_object(vm, *array);
+    flush_output(vm);
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    rewind(file);
+    length = fread(output, 1, sizeof(output) - 1, file);
+    output[length] = '\0';
+    fclose(file);
+    close_handle_scope(&scope);
+    delete_vm(vm);
+    delete_heap(heap);
+    if (strcmp(output, expected) != 0)
+    {
+        printf("FAIL: printed %s, expected %s\n", output, expected);
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
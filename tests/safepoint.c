@@ -0,0 +1,78 @@
+/*
+ * Runs a script that allocates nothing on one thread while another thread
+ * sharing its heap collects garbage, first with the interpreter and then with
+ * the JIT. The spinning thread must reach a safepoint every time, in well
+ * under a second. Build and run from this directory:
+ *
+ * gcc -DGC_NO_MAIN safepoint.c -pthread -lm && ./a.out >/dev/null
+ *
+ * The collector reports every object it looks at on standard output, so the
+ * result goes to standard error.
+ */
+#include "../gc.c"
+
+#define COLLECTIONS 100
+#define MAXIMUM_TIME_TO_SAFEPOINT 0.5
+
+atomic_int spinning;
+atomic_int stopping;
+
+void *spin(void *argument)
+{
+    struct VM *vm = argument;
+    while (!atomic_load(&stopping))
+    {
+        run(vm);
+        atomic_store(&spinning, 1);
+    }
+    return NULL;
+}
+
+void collect_while_spinning(struct VM *collector, struct VM *spinner)
+{
+    pthread_t thread;
+    int i;
+    atomic_store(&spinning, 0);
+    atomic_store(&stopping, 0);
+    pthread_create(&thread, NULL, spin, spinner);
+    while (!atomic_load(&spinning))
+    {
+        sched_yield();
+    }
+    for (i = 0; i < COLLECTIONS; i++)
+    {
+        stop_the_world_mark_and_sweep(collector);
+    }
+    atomic_store(&stopping, 1);
+    pthread_join(thread, NULL);
+}
+
+int main(void)
+{
+    struct Heap *heap = new_heap();
+    struct VM *collector = new_vm(heap, "");
+    struct VM *spinner = new_vm(heap, "1 pop 2 pop 3 pop 4 pop 5 pop 6 pop 7 pop 8 pop");
+    int count;
+    double total;
+    double maximum;
+    int expected = COLLECTIONS;
+    alarm(10);
+    compile(spinner);
+    collect_while_spinning(collector, spinner);
+#ifdef JIT
+    jit_compile(spinner);
+    collect_while_spinning(collector, spinner);
+    expected += COLLECTIONS;
+#endif
+    get_safepoint_statistics(heap, &count, &total, &maximum);
+    delete_vm(spinner);
+    delete_vm(collector);
+    delete_heap(heap);
+    if (count != expected || maximum > MAXIMUM_TIME_TO_SAFEPOINT)
+    {
+        fprintf(stderr, "FAIL: %d safepoints, expected %d, longest took %fs\n", count, expected, maximum);
+        return 1;
+    }
+    fprintf(stderr, "PASS\n");
+    return 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * Checks that weak references and ephemeron tables don't keep objects alive:
+ * a weak reference is cleared and an ephemeron's value is deleted once the
+ * last strong reference to the target or key is gone, even if the value
+ * references its own key, while values reachable through live keys survive.
+ * Build and run from this directory:
+ *
+ * gcc -I.. -DGC_NO_MAIN ../gc.c weak.c -pthread -lm && ./a.out >/dev/null
+ *
+ * The collector reports every object it looks at on standard output, so the
+ * result goes to standard error.
+ */
+#include <stdio.h>
+#include "gc.h"
+
+int main(void)
+{
+    struct Heap *heap = new_heap();
+    struct VM *vm = new_vm(heap, "");
+    struct HandleScope scope;
+    struct Object **table;
+    struct Object **key;
+    struct Object **value;
+    struct Object **chained;
+    struct Object **dead_key;
+    struct Object **dead_value;
+    struct Object **cyclic_key;
+    struct Object **cyclic_value;
+    int passed = 1;
+    open_handle_scope(vm, &scope);
+    table = new_handle(vm, new_ephemeron_table(vm));
+    key = new_handle(vm, new_string(vm, "key"));
+    value = new_handle(vm, new_weak_ref(vm, new_string(vm, "value")));
+    chained = new_handle(vm, new_weak_ref(vm, new_string(vm, "chained")));
+    set_ephemeron(*table, weak_ref_target(*value), weak_ref_target(*chained));
+    set_ephemeron(*table, *key, weak_ref_target(*value));
+    dead_key = new_handle(vm, new_weak_ref(vm, new_string(vm, "dead key")));
+    dead_value = new_handle(vm, new_weak_ref(vm, new_string(vm, "dead value")));
+    set_ephemeron(*table, weak_ref_target(*dead_key), weak_ref_target(*dead_value));
+    cyclic_key = new_handle(vm, new_weak_ref(vm, new_string(vm, "cyclic key")));
+    cyclic_value = new_handle(vm, new_weak_ref(vm, new_array(vm)));
+    append_element(vm, weak_ref_target(*cyclic_value), weak_ref_target(*cyclic_key));
+    set_ephemeron(*table, weak_ref_target(*cyclic_key), weak_ref_target(*cyclic_value));
+    stop_the_world_mark_and_sweep(vm);
+    if (weak_ref_target(*dead_key) || weak_ref_target(*dead_value))
+    {
+        fprintf(stderr, "FAIL: entry with an unreachable key survived\n");
+        passed = 0;
+    }
+    if (weak_ref_target(*cyclic_key) || weak_ref_target(*cyclic_value))
+    {
+        fprintf(stderr, "FAIL: value referencing its own key kept it alive\n");
+        passed = 0;
+    }
+    if (!weak_ref_target(*value) || get_ephemeron(*table, *key) != weak_ref_target(*value) || !weak_ref_target(*chained))
+    {
+        fprintf(stderr, "FAIL: values reachable through a live key were deleted\n");
+        passed = 0;
+    }
+    *key = NULL;
+    stop_the_world_mark_and_sweep(vm);
+    if (weak_ref_target(*value) || weak_ref_target(*chained))
+    {
+        fprintf(stderr, "FAIL: values survived the last reference to their key\n");
+        passed = 0;
+    }
+    close_handle_scope(&scope);
+    delete_vm(vm);
+    delete_heap(heap);
+    if (!passed)
+    {
+        return 1;
+    }
+    fprintf(stderr, "PASS\n");
+    return 0;
+}